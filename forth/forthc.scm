@@ -127,10 +127,15 @@
     (error "Malformed word:" form))
   (let ((name (define-word (car form)))
         (body (cdr form))
-        (locals '()))
+        (locals '())
+        (tail-recursive? #f))
     ;; TODO: Ensure there are no duplicate local variable names.
     (let gather-locals ((tail body) (new-body '()))
-      (cond ((null? tail)
+      (cond ((and (null? tail) (pair? new-body)
+                  (equal? '|...| (car new-body)))
+             (set! tail-recursive? #t)
+             (set! body (reverse (cdr new-body))))
+            ((null? tail)
              (set! body (reverse new-body)))
             ((and (list? (car tail)) (not (equal? 'quote (caar tail))))
              (set! locals (append locals (car tail)))
@@ -142,6 +147,8 @@
     (for-each (lambda (local)
                 (disp ind "uintptr_t " (mangle-local local) ";"))
               locals)
+    (when tail-recursive?
+      (disp "top:"))
     (for-each (lambda (part)
                 (cond ((equal? '& part)
                        (disp ind "if (!flag) {")
@@ -152,6 +159,8 @@
                        (disp ind ind "return;")
                        (disp ind "}"))
                       ((equal? '|...| part)
+                       (edisp "Warning: ... is not in tail position in "
+                              (car form))
                        (disp ind name "();"))
                       ((and (list? part) (equal? 'quote (car part)))
                        (let ((w (lookup-word (cadr part))))
@@ -177,6 +186,8 @@
                       (else
                        (error "What?" part))))
               body)
+    (when tail-recursive?
+      (disp ind "goto top;"))
     (disp "}")))
 
 (define (main)
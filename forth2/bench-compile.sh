@@ -0,0 +1,93 @@
+#!/bin/sh
+# Measure how the compiler scales with the size of the program, on
+# synthetic sources of 1k to 100k definitions. Each line of the report is
+# one source, tagged with the commit so that runs can be compared. A
+# million definitions need several GB of memory, but can be given in
+# SIZES.
+#
+# For each size there are two sources. In the first, the definitions come
+# in chains of CHAIN words, each calling the one before it, and take turns
+# at being heavy on locals, on string literals, and on names that mangle
+# to the same C name. Words that call 16 words each tie the chains
+# together so that main reaches all of them. In the second, all the
+# definitions form one chain of small words that could be inlined, which
+# is as deep as the call graph gets.
+set -eu
+cd "$(dirname "$0")"
+echo "Entering directory $PWD"
+CC="${CC:-clang}"
+CFLAGS="${CFLAGS:--Weverything -Werror -Wno-unused-function -pedantic -std=gnu99 -O2}"
+SIZES="${SIZES:-1000 10000 100000}"
+CHAIN="${CHAIN:-32}"
+SOURCE="$(mktemp "${TMPDIR:-/tmp}/bench-XXXXXX.4th")"
+trap 'rm -f "$SOURCE"' EXIT
+COMMIT="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+set -x
+$CC $CFLAGS -o forthc forthc.c
+set +x
+for ndef in $SIZES; do
+    awk -v ndef="$ndef" -v chain="$CHAIN" 'BEGIN {
+        print "\\ synthetic compiler benchmark"
+        print "variable counter"
+        seps = "-_.%,~^&"
+        for (i = 0; i < ndef; i++) {
+            shape = i % 4
+            if (shape == 2) {
+                name = sprintf("k%s%d", substr(seps, int(i / 4) % 8 + 1, 1),
+                    int(i / 32))
+            } else {
+                name = sprintf("w%d", i)
+            }
+            printf ": %s ( x )", name
+            if (shape == 0) {
+                printf " x 1 + ( a ) a 2 * ( b ) a b + ( c ) c b - ( d )"
+                printf " d a - drop"
+            } else if (shape == 1) {
+                printf " \"string literal number %d\" drop", i
+                printf " \"and another\" drop"
+            } else if (shape == 2) {
+                printf " x 3 + counter + counter!"
+            } else {
+                printf " counter x + 0x%x and-bits counter!", i
+            }
+            printf " x"
+            if (i % chain) {
+                printf " %s", last
+            }
+            print " ;"
+            last = name
+            if ((i % chain == chain - 1) || (i == ndef - 1)) {
+                heads[nhead++] = name
+            }
+        }
+        for (level = 0; nhead > 1; level++) {
+            n = 0
+            for (i = 0; i < nhead; i += 16) {
+                name = sprintf("fan-%d-%d", level, n)
+                printf ": %s ( x ) x", name
+                for (j = i; (j < i + 16) && (j < nhead); j++) {
+                    printf " %s", heads[j]
+                }
+                print " ;"
+                heads[n++] = name
+            }
+            nhead = n
+        }
+        printf ": main 0 counter! 1 %s drop ;\n", heads[0]
+    }' >"$SOURCE"
+    printf '%s %s definitions: ' "$COMMIT" "$ndef"
+    ./forthc -b "$SOURCE" 2>&1 >/dev/null | sed 's/^stats: //'
+    awk -v ndef="$ndef" 'BEGIN {
+        print "\\ synthetic compiler benchmark, one chain"
+        for (i = 0; i < ndef; i++) {
+            printf ": c%d ( x ) x", i
+            if (i) {
+                printf " c%d", i - 1
+            }
+            print " ;"
+        }
+        printf ": main 1 c%d drop ;\n", ndef - 1
+    }' >"$SOURCE"
+    printf '%s %s chained definitions: ' "$COMMIT" "$ndef"
+    ./forthc -b "$SOURCE" 2>&1 >/dev/null | sed 's/^stats: //'
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Measure tokenizer throughput on a large synthetic source file.
+set -eu
+cd "$(dirname "$0")"
+echo "Entering directory $PWD"
+CC=clang
+CFLAGS="-Weverything -Werror -Wno-unused-function -pedantic -std=gnu99 -O2"
+NDEF="${NDEF:-200000}"
+SOURCE="$(mktemp "${TMPDIR:-/tmp}/bench-XXXXXX.4th")"
+trap 'rm -f "$SOURCE"' EXIT
+awk -v ndef="$NDEF" 'BEGIN {
+    print "\\ synthetic tokenizer benchmark"
+    print "variable counter"
+    for (i = 0; i < ndef; i++) {
+        printf ": word-%d ( a b ) a b + 0x%x and-bits dup 0 > &\n", i, i
+        printf "    \"string literal number %d\" drop\n", i
+        printf "    counter 1 + counter! -%d drop ;\n", i
+    }
+    print ": main 1 2 word-0 drop ;"
+}' >"$SOURCE"
+set -x
+$CC $CFLAGS -o forthc forthc.c
+./forthc -T "$SOURCE"
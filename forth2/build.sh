@@ -13,6 +13,10 @@ LFLAGS="-lm"
 set -x
 cloc -q forth* *.4th || true
 $CC $LFLAGS $CFLAGS -o forthc forthc.c
-./forthc scheme.4th >scheme.h.new
-mv -f scheme.h.new scheme.h
-$CC $LFLAGS $CFLAGS -o scheme forth.c
+./forthc -c .forthc-cache -o scheme.h scheme.4th
+for dep in forth.c forth_stack.h forth_os_unix.h scheme.h; do
+    if [ ! scheme -nt "$dep" ]; then
+        $CC $LFLAGS $CFLAGS -o scheme forth.c
+        break
+    fi
+done
@@ -0,0 +1,531 @@
+// Forth runtime, shared by forth.c and by the shards that forthc -S splits
+// the generated code into. The includer defines FORTH_STACK_CELLS and
+// FORTH_STACK_VERIFIED first if forthc has proved how deep the stack gets.
+// Pushes are not checked: forth_stack.h catches overflows with a guard page.
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef void (*word_func_t)(void);
+
+static void die(const char *msg) __attribute__((__noreturn__));
+static void *die_if_no_memory(void *p);
+static void die_if_overflow(bool overflow);
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(2);
+}
+
+static void *die_if_no_memory(void *p)
+{
+    if (!p) {
+        die("out of memory");
+    }
+    return p;
+}
+
+static void die_if_overflow(bool overflow)
+{
+    if (overflow) {
+        die("numeric overflow");
+    }
+}
+
+// The size of the stack, unless the environment says otherwise.
+#ifndef FORTH_STACK_CELLS
+#define FORTH_STACK_CELLS 1024
+#endif
+
+// With FORTH_THREADS, every thread that runs Forth code has its own stack
+// and flag, as well as its own copy of each thread-variable.
+#ifdef FORTH_THREADS
+#define FORTH_THREAD_LOCAL __thread
+#else
+#define FORTH_THREAD_LOCAL
+#endif
+
+// The stack starts at stackbuf + 1. The spare cell below it lets code that
+// keeps the top of the stack in a register store an empty stack back.
+extern FORTH_THREAD_LOCAL uintptr_t *stackbuf;
+extern FORTH_THREAD_LOCAL uintptr_t *stack;
+extern FORTH_THREAD_LOCAL bool flag;
+
+#ifdef FORTH_THREADS
+void prim_spawn(void);
+void prim_join(void);
+#endif
+
+#ifdef FORTH_PROFILE
+// A word compiled with forthc -p counts its calls and its time here. The
+// runtime links it into its list on the first call.
+struct profile_word {
+    const char *name;
+    struct profile_word *next;
+    uint64_t calls;
+    uint64_t self; // time spent in the word itself
+    uint64_t total; // time including the words that it calls
+    size_t active; // calls that have not returned yet
+};
+
+// And each & or | exit counts which way it goes.
+struct profile_branch {
+    struct profile_branch *next;
+    size_t line;
+    size_t column;
+    uint64_t taken;
+    uint64_t not_taken;
+};
+
+void profile_enter(struct profile_word *word);
+void profile_leave(void);
+bool profile_count_branch(struct profile_branch *branch, bool taken);
+extern uintptr_t *profile_stack_max;
+#endif
+
+static size_t bytes_from_cells(uintptr_t n)
+{
+    size_t nbytes;
+    die_if_overflow(__builtin_mul_overflow(n, sizeof(void *), &nbytes));
+    return nbytes;
+}
+
+static uintptr_t checked_add(uintptr_t a, uintptr_t b)
+{
+    uintptr_t c;
+    die_if_overflow(__builtin_add_overflow(a, b, &c));
+    return c;
+}
+
+static uintptr_t checked_sub(uintptr_t a, uintptr_t b)
+{
+    uintptr_t c;
+    die_if_overflow(__builtin_sub_overflow(a, b, &c));
+    return c;
+}
+
+static uintptr_t checked_sub_s(uintptr_t a, uintptr_t b)
+{
+    intptr_t c;
+    die_if_overflow(__builtin_sub_overflow((intptr_t)a, (intptr_t)b, &c));
+    return (uintptr_t)c;
+}
+
+static uintptr_t checked_mul(uintptr_t a, uintptr_t b)
+{
+    uintptr_t c;
+    die_if_overflow(__builtin_mul_overflow(a, b, &c));
+    return c;
+}
+
+static void check_pop(void)
+{
+#ifndef FORTH_STACK_VERIFIED
+    if (stack == stackbuf + 1) {
+        die("stack underflow");
+    }
+#endif
+}
+
+static void push(uintptr_t x)
+{
+    *stack++ = x;
+#ifdef FORTH_PROFILE
+    if (stack > profile_stack_max) {
+        profile_stack_max = stack;
+    }
+#endif
+}
+
+static void pushsigned(intptr_t x) { push((uintptr_t)x); }
+static void pushpointer(void *x) { push((uintptr_t)x); }
+static void pushfunc(word_func_t func) { push((uintptr_t)func); }
+static void push_c_string(const char *str)
+{
+    push((uintptr_t)str);
+    push(strlen(str));
+}
+
+static uintptr_t peek(void)
+{
+    check_pop();
+    return stack[-1];
+}
+
+static uintptr_t pop(void)
+{
+    check_pop();
+    return *--stack;
+}
+
+static void drop(void)
+{
+    check_pop();
+    stack--;
+}
+static void *poppointer(void) { return (void *)(pop()); }
+static size_t popsize(void) { return (size_t)pop(); }
+static int popint(void) { return (int)pop(); }
+
+static void pop2(uintptr_t *a, uintptr_t *b)
+{
+    *b = pop();
+    *a = pop();
+}
+
+static void pop2signed(intptr_t *a, intptr_t *b)
+{
+    *b = (intptr_t)pop();
+    *a = (intptr_t)pop();
+}
+
+static void peekpop(uintptr_t *a, uintptr_t *b)
+{
+    *b = pop();
+    *a = peek();
+}
+
+static void peekpopsigned(intptr_t *a, intptr_t *b)
+{
+    *b = (intptr_t)(pop());
+    *a = (intptr_t)(peek());
+}
+
+#ifdef FORTH_REGISTER_ABI
+// With forthc -r, each word takes the stack pointer, the top of the stack
+// and flag as its argument and returns them, so that they stay in registers
+// across calls. sp points at the cell where the top of the stack belongs,
+// which is only written when the value in tos is pushed down. flag is the
+// low bit of sp. Primitives still use the globals, which are brought up to
+// date around each call to one.
+typedef struct {
+    uintptr_t spf;
+    uintptr_t tos;
+} forth_regs;
+
+typedef forth_regs (*forth_word_t)(forth_regs);
+
+#define FORTH_SP(regs) ((uintptr_t *)((regs).spf & ~(uintptr_t)1))
+#define FORTH_FLAG(regs) (((regs).spf & 1) != 0)
+#define FORTH_REGS() ((forth_regs) { (uintptr_t)sp | (uintptr_t)lflag, tos })
+
+#define FORTH_ENTER()                                                        \
+    uintptr_t *sp = FORTH_SP(regs);                                         \
+    uintptr_t tos = regs.tos;                                               \
+    bool lflag = FORTH_FLAG(regs);                                          \
+    (void)sp, (void)tos, (void)lflag
+#define FORTH_RETURN return FORTH_REGS()
+
+#define FORTH_PUSH(x) (*sp++ = tos, tos = (x))
+#define FORTH_DROP() (forth_check_pop(sp), tos = *--sp)
+
+#define FORTH_CALL(word)                                                     \
+    (regs = word(FORTH_REGS()), sp = FORTH_SP(regs), tos = regs.tos,        \
+        lflag = FORTH_FLAG(regs))
+#define FORTH_TAIL_CALL(word) return word(FORTH_REGS())
+#define FORTH_PRIM(prim)                                                     \
+    (*sp = tos, stack = sp + 1, flag = lflag, prim(), sp = stack - 1,        \
+        tos = *sp, lflag = flag)
+
+static void forth_check_pop(const uintptr_t *sp)
+{
+#ifndef FORTH_STACK_VERIFIED
+    if (sp == stackbuf) {
+        die("stack underflow");
+    }
+#else
+    (void)sp;
+#endif
+}
+
+// Calls a word from code that keeps the stack in the globals.
+static void forth_call_word(forth_word_t word)
+{
+    forth_regs regs;
+
+    regs.spf = (uintptr_t)(stack - 1) | (uintptr_t)flag;
+    regs.tos = stack[-1];
+    regs = word(regs);
+    stack = FORTH_SP(regs) + 1;
+    stack[-1] = regs.tos;
+    flag = FORTH_FLAG(regs);
+}
+#endif
+
+#include "forth_os_unix.h"
+
+static void prim_flag(void) { push(flag); }
+
+static void prim_drop(void) { drop(); }
+
+static void prim_dup(void) { push(peek()); }
+
+static void prim_ne(void)
+{
+    uintptr_t a, b;
+    peekpop(&a, &b);
+    flag = a != b;
+}
+
+static void prim_eq(void)
+{
+    uintptr_t a, b;
+    peekpop(&a, &b);
+    flag = a == b;
+}
+
+static void prim_lt(void)
+{
+    uintptr_t a, b;
+    peekpop(&a, &b);
+    flag = a < b;
+}
+
+static void prim_lt_s(void)
+{
+    intptr_t a, b;
+    peekpopsigned(&a, &b);
+    flag = a < b;
+}
+
+static void prim_gt(void)
+{
+    uintptr_t a, b;
+    peekpop(&a, &b);
+    flag = a > b;
+}
+
+static void prim_gt_s(void)
+{
+    intptr_t a, b;
+    peekpopsigned(&a, &b);
+    flag = a > b;
+}
+
+static void prim_le(void)
+{
+    uintptr_t a, b;
+    peekpop(&a, &b);
+    flag = a <= b;
+}
+
+static void prim_le_s(void)
+{
+    intptr_t a, b;
+    peekpopsigned(&a, &b);
+    flag = a <= b;
+}
+
+static void prim_ge(void)
+{
+    uintptr_t a, b;
+    peekpop(&a, &b);
+    flag = a >= b;
+}
+
+static void prim_ge_s(void)
+{
+    intptr_t a, b;
+    peekpopsigned(&a, &b);
+    flag = a >= b;
+}
+
+static void prim_plus(void)
+{
+    uintptr_t a, b, c;
+    pop2(&a, &b);
+    die_if_overflow(__builtin_add_overflow(a, b, &c));
+    push(c);
+}
+
+static void prim_plus_carry(void)
+{
+    uintptr_t a, b, c;
+    pop2(&a, &b);
+    flag = __builtin_add_overflow(a, b, &c);
+    push(c);
+}
+
+static void prim_plus_s(void)
+{
+    intptr_t a, b, c;
+    pop2signed(&a, &b);
+    die_if_overflow(__builtin_add_overflow(a, b, &c));
+    pushsigned(c);
+}
+
+static void prim_minus(void)
+{
+    uintptr_t a, b, c;
+    pop2(&a, &b);
+    die_if_overflow(__builtin_sub_overflow(a, b, &c));
+    push(c);
+}
+
+static void prim_minus_s(void)
+{
+    intptr_t a, b, c;
+    pop2signed(&a, &b);
+    die_if_overflow(__builtin_sub_overflow(a, b, &c));
+    pushsigned(c);
+}
+
+static void prim_star(void)
+{
+    uintptr_t a, b, c;
+    pop2(&a, &b);
+    die_if_overflow(__builtin_mul_overflow(a, b, &c));
+    push(c);
+}
+
+static void prim_star_s(void)
+{
+    intptr_t a, b, c;
+    pop2signed(&a, &b);
+    die_if_overflow(__builtin_mul_overflow(a, b, &c));
+    pushsigned(c);
+}
+
+static void prim_cells(void)
+{
+    push(sizeof(uintptr_t));
+    prim_star();
+}
+
+static void prim_cell_bits(void) { push(sizeof(uintptr_t) * CHAR_BIT); }
+
+static uintptr_t max_to_n_bits(uintptr_t max)
+{
+    unsigned long x = max;
+    unsigned int width = sizeof(x) * CHAR_BIT;
+    return width - (unsigned int)__builtin_clzl(x);
+}
+
+static void prim_max_to_n_bits(void) { push(max_to_n_bits(pop())); }
+
+static void prim_n_bits_to_bitmask(void)
+{
+    uintptr_t n_bits = pop();
+    push(((uintptr_t)1 << n_bits) - 1);
+}
+
+static void prim_and_bits(void)
+{
+    uintptr_t a, b;
+    pop2(&a, &b);
+    push(a & b);
+}
+
+static void prim_or_bits(void)
+{
+    uintptr_t a, b;
+    pop2(&a, &b);
+    push(a | b);
+}
+
+static void prim_call(void)
+{
+#ifdef FORTH_REGISTER_ABI
+    forth_call_word((forth_word_t)pop());
+#else
+    word_func_t func = (word_func_t)poppointer();
+    func();
+#endif
+}
+
+static void prim_allocate(void)
+{
+    pushpointer(die_if_no_memory(calloc(1, popsize())));
+}
+
+static void prim_reallocate(void)
+{
+    void *p = poppointer();
+    pushpointer(die_if_no_memory(realloc(p, popsize())));
+}
+
+static void prim_deallocate(void) { free(poppointer()); }
+
+static void prim_fetch(void)
+{
+    uintptr_t *p = poppointer();
+    push(*p);
+}
+
+static void prim_store(void)
+{
+    uintptr_t *p = poppointer();
+    *p = pop();
+}
+
+static void prim_byte_fetch(void)
+{
+    uint8_t *p = poppointer();
+    push(*p);
+}
+
+static void prim_byte_store(void)
+{
+    uint8_t *p = poppointer();
+    *p = (uint8_t)(pop());
+}
+
+static void prim_bytes_equal(void)
+{
+    uintptr_t nbyte = pop();
+    uint8_t *b = poppointer();
+    uint8_t *a = poppointer();
+    flag = 1;
+    for (; nbyte; nbyte--) {
+        flag &= (*a++ == *b++);
+    }
+}
+
+static void prim_zero_cells(void)
+{
+    size_t nbytes = bytes_from_cells(popsize());
+    memset_s(poppointer(), nbytes, 0, nbytes);
+}
+
+static void prim_show(void) { fprintf(stderr, "%" PRIuPTR "\n", peek()); }
+
+static void prim_shows(void)
+{
+    fprintf(stderr, "%" PRIdPTR "\n", (intptr_t)peek());
+}
+
+static void prim_show_hex(void)
+{
+    fprintf(stderr, "0x%" PRIxPTR "\n", peek());
+}
+
+static void prim_show_byte(void)
+{
+    fprintf(stderr, "%c", (int)(uint8_t)(peek()));
+}
+
+static void prim_show_bytes(void)
+{
+    size_t n = popsize();
+    fwrite(poppointer(), 1, n, stderr);
+}
+
+static void prim_show_stack(void)
+{
+    uintptr_t *p;
+
+    fprintf(stderr, "(");
+    p = stackbuf + 1;
+    if (p < stack) {
+        fprintf(stderr, "%" PRIdPTR, *p++);
+    }
+    while (p < stack) {
+        fprintf(stderr, " %" PRIdPTR, *p++);
+    }
+    fprintf(stderr, ") %c\n", flag ? 'T' : 'F');
+}
@@ -0,0 +1,251 @@
+// Profiler for programs compiled with forthc -p, included by forth.c. Each
+// word counts its calls and its time, both self and total, and each call
+// path through the words gets its own self time. At exit the words go to
+// stderr sorted by self time, and the call paths go to the file named by
+// FORTH_PROFILE_FOLDED (forth-profile.folded by default) in the folded
+// format that flame graph tools read. The counts of the words and of the
+// exits go to FORTH_PROFILE_FILE (forth-profile.txt by default), which
+// forthc -u reads to tune the code for the same workload.
+
+#include <time.h>
+
+#define PROFILE_MAX_DEPTH 4096
+#define PROFILE_MAX_NODES 65536
+
+// The path from the root of the call tree to a node is a call path.
+struct profile_node {
+    struct profile_word *word;
+    uint64_t self;
+    size_t parent;
+    size_t child; // first callee, or 0
+    size_t sibling; // next callee of the parent, or 0
+};
+
+struct profile_frame {
+    struct profile_word *word;
+    uint64_t start;
+    uint64_t children; // time spent in the words that it called
+    size_t node;
+};
+
+uintptr_t *profile_stack_max; // set by main
+static struct profile_word *profile_words;
+static struct profile_branch *profile_branches;
+static struct profile_frame profile_frames[PROFILE_MAX_DEPTH];
+static size_t profile_depth;
+static size_t profile_lost_depth; // calls nested deeper than the frames
+static struct profile_node profile_nodes[PROFILE_MAX_NODES];
+static size_t profile_nnodes = 1; // node 0 is the root
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_UNIT "cycles"
+static uint64_t profile_now(void) { return __builtin_ia32_rdtsc(); }
+#else
+#define PROFILE_UNIT "ns"
+static uint64_t profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// Once the tree is full, new call paths are charged to the caller's path.
+static size_t profile_node(size_t parent, struct profile_word *word)
+{
+    size_t i;
+
+    for (i = profile_nodes[parent].child; i; i = profile_nodes[i].sibling) {
+        if (profile_nodes[i].word == word) {
+            return i;
+        }
+    }
+    if (profile_nnodes == PROFILE_MAX_NODES) {
+        return parent;
+    }
+    i = profile_nnodes++;
+    profile_nodes[i].word = word;
+    profile_nodes[i].parent = parent;
+    profile_nodes[i].sibling = profile_nodes[parent].child;
+    profile_nodes[parent].child = i;
+    return i;
+}
+
+void profile_enter(struct profile_word *word)
+{
+    struct profile_frame *frame;
+
+    if (!word->calls++) {
+        word->next = profile_words;
+        profile_words = word;
+    }
+    if (profile_depth == PROFILE_MAX_DEPTH) {
+        profile_lost_depth++;
+        return;
+    }
+    frame = &profile_frames[profile_depth];
+    frame->word = word;
+    frame->children = 0;
+    frame->node = profile_node(
+        profile_depth ? profile_frames[profile_depth - 1].node : 0, word);
+    profile_depth++;
+    word->active++;
+    frame->start = profile_now();
+}
+
+// The total time of a recursive word is only counted at its outermost
+// call, so that time is not counted twice.
+static void profile_close_frame(uint64_t now)
+{
+    struct profile_frame *frame = &profile_frames[--profile_depth];
+    uint64_t elapsed = now - frame->start;
+    uint64_t self;
+
+    self = (elapsed > frame->children) ? elapsed - frame->children : 0;
+    frame->word->self += self;
+    profile_nodes[frame->node].self += self;
+    if (!--frame->word->active) {
+        frame->word->total += elapsed;
+    }
+    if (profile_depth) {
+        profile_frames[profile_depth - 1].children += elapsed;
+    }
+}
+
+void profile_leave(void)
+{
+    if (profile_lost_depth) {
+        profile_lost_depth--;
+        return;
+    }
+    profile_close_frame(profile_now());
+}
+
+bool profile_count_branch(struct profile_branch *branch, bool taken)
+{
+    if (!branch->taken && !branch->not_taken) {
+        branch->next = profile_branches;
+        profile_branches = branch;
+    }
+    if (taken) {
+        branch->taken++;
+    } else {
+        branch->not_taken++;
+    }
+    return taken;
+}
+
+static int profile_compare(const void *a, const void *b)
+{
+    const struct profile_word *x = *(struct profile_word *const *)a;
+    const struct profile_word *y = *(struct profile_word *const *)b;
+
+    return (x->self < y->self) - (x->self > y->self);
+}
+
+static void profile_write_path(FILE *file, size_t node)
+{
+    if (profile_nodes[node].parent) {
+        profile_write_path(file, profile_nodes[node].parent);
+        fputc(';', file);
+    }
+    fputs(profile_nodes[node].word->name, file);
+}
+
+static void profile_write_folded(void)
+{
+    const char *name = getenv("FORTH_PROFILE_FOLDED");
+    FILE *file;
+    size_t i;
+
+    if (!name) {
+        name = "forth-profile.folded";
+    }
+    if (!(file = fopen(name, "w"))) {
+        fprintf(stderr, "cannot write %s\n", name);
+        return;
+    }
+    for (i = 1; i < profile_nnodes; i++) {
+        if (profile_nodes[i].self) {
+            profile_write_path(file, i);
+            fprintf(file, " %" PRIu64 "\n", profile_nodes[i].self);
+        }
+    }
+    if (fclose(file)) {
+        fprintf(stderr, "cannot write %s\n", name);
+    }
+}
+
+// In the format that forthc -u reads.
+static void profile_write_counts(void)
+{
+    const char *name = getenv("FORTH_PROFILE_FILE");
+    struct profile_branch *branch;
+    struct profile_word *word;
+    FILE *file;
+
+    if (!name) {
+        name = "forth-profile.txt";
+    }
+    if (!(file = fopen(name, "w"))) {
+        fprintf(stderr, "cannot write %s\n", name);
+        return;
+    }
+    fprintf(file, "forth-profile 1\nsource %s\n", FORTH_PROFILE_SOURCE);
+    for (word = profile_words; word; word = word->next) {
+        fprintf(file, "word %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n",
+            word->calls, word->self, word->total, word->name);
+    }
+    for (branch = profile_branches; branch; branch = branch->next) {
+        fprintf(file, "branch %zu %zu %" PRIu64 " %" PRIu64 "\n",
+            branch->line, branch->column, branch->taken, branch->not_taken);
+    }
+    if (fclose(file)) {
+        fprintf(stderr, "cannot write %s\n", name);
+    }
+}
+
+// Runs at exit. Words that are still running, such as main, are charged
+// up to now.
+static void profile_dump(void)
+{
+    struct profile_word **sorted;
+    struct profile_word *word;
+    uint64_t now = profile_now();
+    uint64_t all = 0;
+    size_t n = 0;
+    size_t i;
+
+    profile_lost_depth = 0;
+    while (profile_depth) {
+        profile_close_frame(now);
+    }
+    for (word = profile_words; word; word = word->next) {
+        all += word->self;
+        n++;
+    }
+    if (!(sorted = calloc(n + 1, sizeof(*sorted)))) {
+        fprintf(stderr, "out of memory\n");
+        return;
+    }
+    for (word = profile_words, i = 0; word; word = word->next) {
+        sorted[i++] = word;
+    }
+    qsort(sorted, n, sizeof(*sorted), profile_compare);
+    fprintf(stderr, "%12s %16s %6s %16s  %s\n", "calls",
+        "self " PROFILE_UNIT, "self", "total " PROFILE_UNIT, "word");
+    for (i = 0; i < n; i++) {
+        word = sorted[i];
+        fprintf(stderr,
+            "%12" PRIu64 " %16" PRIu64 " %5.1f%% %16" PRIu64 "  %s\n",
+            word->calls, word->self,
+            all ? 100.0 * (double)word->self / (double)all : 0.0,
+            word->total, word->name);
+    }
+    fprintf(stderr, "stack high-water mark: %td cells\n",
+        profile_stack_max - (stackbuf + 1));
+    free(sorted);
+    profile_write_folded();
+    profile_write_counts();
+}
@@ -0,0 +1,126 @@
+// The data stack, included by forth.c and forthi.c. It is mapped with a
+// page right after it that cannot be touched, so that push needs no check:
+// running off the end faults, and the handler reports a stack overflow.
+// FORTH_STACK_CELLS in the environment sets the size at startup, but never
+// below what forthc has proved the program needs. With FORTH_STACK_GROW
+// set, running into the guard page grows the stack instead, up to
+// STACK_RESERVE bytes. With FORTH_THREADS, each thread maps a stack of its
+// own the same way.
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define STACK_RESERVE ((size_t)1 << 30)
+
+FORTH_THREAD_LOCAL uintptr_t *stackbuf;
+FORTH_THREAD_LOCAL uintptr_t *stack;
+static FORTH_THREAD_LOCAL char *stack_map;
+static FORTH_THREAD_LOCAL size_t stack_map_size; // with the guard page
+static FORTH_THREAD_LOCAL size_t stack_usable; // can be read and written
+static size_t stack_cells;
+static size_t stack_page;
+static bool stack_grow;
+
+#ifdef FORTH_PROFILE
+// Programs compiled with -p have no threads, and main sets this up to exit
+// through die so that the profile is still written on an overflow.
+static sigjmp_buf stack_overflow_exit;
+#endif
+
+// Only async-signal-safe calls can be made here, so an overflow is reported
+// with write and _exit, and output that stdio still buffers is lost. With
+// threads, exit would also run the atexit handlers while the others go on.
+// Any other fault is raised again with the default action.
+static void stack_fault(int sig, siginfo_t *info, void *context)
+{
+    static const char msg[] = "stack overflow\n";
+    char *addr = info->si_addr;
+    size_t more = stack_usable;
+    ssize_t written;
+
+    (void)context;
+    if ((addr < stack_map + stack_usable)
+        || (addr >= stack_map + stack_map_size)) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+    if (stack_grow) {
+        if (more > stack_map_size - stack_page - stack_usable) {
+            more = stack_map_size - stack_page - stack_usable;
+        }
+        if (more
+            && !mprotect(stack_map + stack_usable, more,
+                PROT_READ | PROT_WRITE)) {
+            stack_usable += more;
+            return;
+        }
+    }
+#ifdef FORTH_PROFILE
+    siglongjmp(stack_overflow_exit, 1);
+#endif
+    written = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)written;
+    _exit(2);
+}
+
+// Gives the calling thread its stack.
+static void stack_map_new(void)
+{
+    stack_usable = ((1 + stack_cells) * sizeof(uintptr_t) + stack_page - 1)
+        / stack_page * stack_page;
+    stack_map_size = stack_usable;
+    if (stack_grow && (stack_map_size < STACK_RESERVE)) {
+        stack_map_size = STACK_RESERVE;
+    }
+    stack_map_size += stack_page;
+    stack_map = mmap(0, stack_map_size, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ((stack_map == MAP_FAILED)
+        || mprotect(stack_map, stack_usable, PROT_READ | PROT_WRITE)) {
+        die("cannot map the stack");
+    }
+    stackbuf = (uintptr_t *)(void *)stack_map;
+    stack = stackbuf + 1;
+}
+
+static void stack_unmap(void)
+{
+    munmap(stack_map, stack_map_size);
+    stackbuf = stack = 0;
+}
+
+static void stack_init(void)
+{
+    const char *cells_env = getenv("FORTH_STACK_CELLS");
+    struct sigaction action;
+    unsigned long n;
+    char *end;
+
+    stack_cells = FORTH_STACK_CELLS;
+    if (cells_env) {
+        errno = 0;
+        n = strtoul(cells_env, &end, 10);
+        if ((end == cells_env) || *end || errno || (cells_env[0] == '-')
+            || !n || (n > SIZE_MAX / 2 / sizeof(uintptr_t))) {
+            die("bad FORTH_STACK_CELLS");
+        }
+        stack_cells = (size_t)n;
+    }
+#ifdef FORTH_STACK_VERIFIED
+    if (stack_cells < FORTH_STACK_CELLS) {
+        stack_cells = FORTH_STACK_CELLS;
+    }
+#endif
+    stack_grow = getenv("FORTH_STACK_GROW") != 0;
+    stack_page = (size_t)sysconf(_SC_PAGESIZE);
+    stack_map_new();
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = stack_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, 0);
+    sigaction(SIGBUS, &action, 0);
+}
@@ -0,0 +1,52 @@
+// Threads, included by forth.c when the program uses them. "x ' word spawn"
+// runs word on a new thread, with a stack of its own that holds x, and
+// pushes a handle. join takes the handle, waits for the thread to finish,
+// and pushes the top of the thread's stack at the end, or 0 if it was
+// empty. Variables are shared by all the threads, but each thread has its
+// own copy of a thread-variable, starting at 0.
+
+#include <pthread.h>
+
+struct forth_thread {
+    pthread_t id;
+    uintptr_t word;
+    uintptr_t arg;
+    uintptr_t result;
+};
+
+static void *thread_main(void *arg)
+{
+    struct forth_thread *thread = arg;
+
+    stack_map_new();
+    push(thread->arg);
+    push(thread->word);
+    prim_call();
+    thread->result = (stack > stackbuf + 1) ? stack[-1] : 0;
+    stack_unmap();
+    return 0;
+}
+
+void prim_spawn(void)
+{
+    struct forth_thread *thread;
+
+    thread = die_if_no_memory(calloc(1, sizeof(*thread)));
+    thread->word = pop();
+    thread->arg = pop();
+    if (pthread_create(&thread->id, 0, thread_main, thread)) {
+        die("cannot create a thread");
+    }
+    pushpointer(thread);
+}
+
+void prim_join(void)
+{
+    struct forth_thread *thread = poppointer();
+
+    if (pthread_join(thread->id, 0)) {
+        die("cannot join a thread");
+    }
+    push(thread->result);
+    free(thread);
+}
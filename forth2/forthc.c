@@ -1,9 +1,23 @@
 #include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 #define SOURCE "scheme.4th"
 
 #define DEF_COMPILE (1 << 0)
@@ -18,6 +32,58 @@
 #define TOK_UINT (1 << 5)
 #define TOK_NEGINT (1 << 6)
 
+#define CHAR_SPACE (1 << 0)
+#define CHAR_WORD_END (1 << 1)
+#define CHAR_STRING_END (1 << 2)
+
+#define SCAN_SPACES 0 // skip whitespace
+#define SCAN_WORD 1 // find the end of a word
+#define SCAN_STRING 2 // find the closing quote of a string
+
+#define BLOCK_SIZE 64
+
+#define STACK_ADJUST 0 // the real stack grows by arg
+#define STACK_SET_FLAG 1 // flag gets an unknown value
+#define STACK_EXIT_IF 2 // return if flag is set, with arg more values pushed
+#define STACK_RETURN 3 // return at the end of the body
+#define STACK_BLOCK 4 // start of an inlined body that can break
+#define STACK_BREAK_IF 5 // break out of it like STACK_EXIT_IF
+#define STACK_END_BLOCK 6
+#define STACK_CALL 7 // call the word in unit arg
+#define STACK_CALL_QUOTED 8 // call whatever word was quoted
+#define STACK_LOOP 9 // goto top
+#define STACK_HALT 10 // call a primitive that does not return
+
+#define ASM_IMMEDIATE 0
+#define ASM_LOCAL 1
+#define ASM_VARIABLE 2
+#define ASM_ADDRESS 3 // of a string or a word
+#define ASM_RESULT 4 // in %rsi
+#define ASM_REGISTER 5 // a variable kept in a register by a tail loop
+
+#define MAX_HELD 16
+#define ASM_LOCAL_REGS 2
+#define ASM_LOOP_VAR_REGS 4
+
+#define FLAG_UNKNOWN 2 // flag values are 0, 1 or this
+#define MAX_PATHS 16
+
+#define MIN_SWITCH_ARMS 3
+
+// Change whenever the generated code changes, to invalidate old caches.
+#define CACHE_FORMAT "forthc-cache 2"
+
+// The first line of the profile that a program compiled with -p writes at
+// exit, and that -u reads back.
+#define PROFILE_FORMAT "forth-profile 1"
+#define HOT_PERCENT 1 // of all calls or all time that makes a word hot
+#define HOT_INLINE_FACTOR 4 // how much bigger a hot word can be to inline
+#define MAX_INLINE_DEPTH 8 // how deeply inlined words can nest
+#define MIN_BIASED_EXITS 16 // times an exit must run before its bias is used
+
+#define FNV_OFFSET UINT64_C(14695981039346656037)
+#define FNV_PRIME UINT64_C(1099511628211)
+
 struct vec {
     unsigned char *bytes;
     size_t itemsize;
@@ -26,27 +92,216 @@ struct vec {
     size_t mark;
 };
 
+struct slot {
+    char *key;
+    size_t value;
+};
+
+// Open-addressing hash table from strings to sizes.
+struct table {
+    struct slot *slots;
+    size_t cap;
+    size_t len;
+};
+
+// Token strings point into the mapped source and are not null-terminated.
 struct token {
     size_t tag;
-    char *string;
+    const char *string;
+    size_t length;
     uintptr_t number; // number, character, or string-pool index
+    size_t line; // where the token starts, counting from 1
+    size_t column;
+};
+
+// The tokenizer finds token boundaries in bitmasks computed for a whole
+// block of source at a time, by the fastest classifier the CPU supports.
+struct scanner {
+    const char *name;
+    void (*classify_block)(const char *p, uint64_t stops[3]);
+};
+
+// The values that an expression can have, from lo to hi inclusive.
+struct range {
+    uintptr_t lo;
+    uintptr_t hi;
+};
+
+// An operator is a primitive (or variable accessor) that the compiler
+// open-codes as C expressions instead of calling a function. Templates
+// refer to the inputs as $1..$9, with $1 being the deepest one.
+struct op {
+    const char *forth_word;
+    size_t nin;
+    const char *stmt; // statement template, or null
+    const char *flag; // template for the new value of flag, or null
+    const char *outs[2]; // templates for the values pushed, or null
+    char branch; // '&' or '|' to return early on flag afterwards, or 0
+    int (*fold)(const struct range *in, struct range *out); // outs[0]
+    const char *unchecked; // outs[0] when fold proves it cannot fail
+};
+
+// Refine the ranges of the inputs of a comparison whose flag template is
+// flag, knowing whether it was true or false.
+struct guard {
+    const char *flag;
+    void (*if_true)(struct range *a, struct range *b);
+    void (*if_false)(struct range *a, struct range *b);
+};
+
+// A fusion replaces a sequence of words with a single operator.
+struct fusion {
+    const char *words[6];
+    struct op op;
+    size_t fired;
 };
 
 struct definition {
     const char *forth_word;
     char *c_func_name;
     void (*compile)(void);
+    const struct op *op;
     size_t tag;
+    size_t generation;
+    size_t name_token; // token index of the name of a user word
+    size_t body_start; // token index of the body of a user word
+    size_t body_end; // token index of its ";", or 0 while compiling
+    size_t inline_depth; // 1 + how deeply the words it inlines nest
+    size_t unit; // unit holding its C function + 1, or 0
+    size_t data_unit; // unit that its operator refers to + 1, or 0
+    const char *c_var_name; // storage of a variable accessor, or null
+    struct vec *constants; // values pushed by a constant word, or null
+    size_t nin; // stack effect of a primitive or variable accessor
+    size_t nout;
+    int calls_quoted; // the primitive runs a word pushed by '
+    int syncs; // other threads may have stored to variables by its return
+    int sets_flag; // the primitive changes flag
+    int noreturn; // the primitive exits the program
+    int reads_flag; // the primitive looks at flag
+    int noinline;
+};
+
+// The depth of the real stack relative to the depth at entry, and the
+// value of flag, on one path through a function.
+struct path {
+    long level;
+    int flag;
+};
+
+struct paths {
+    size_t len;
+    struct path paths[MAX_PATHS];
+};
+
+// What a function does to the real stack for one value of flag at entry.
+// The exits are the paths that return. Different exits can leave the stack
+// at different depths, as long as flag tells them apart.
+struct effect {
+    int known;
+    long min;
+    long max;
+    struct paths exits;
+};
+
+// The generated code's effect on the real stack is recorded while it is
+// emitted, and worked out once the whole program has been compiled.
+struct stack_event {
+    int kind;
+    int flag; // for STACK_EXIT_IF and STACK_BREAK_IF
+    long arg;
+};
+
+// Counts from a profile read with -u.
+struct word_profile {
+    uint64_t calls;
+    uint64_t self;
+};
+
+struct exit_profile {
+    uint64_t taken;
+    uint64_t not_taken;
+};
+
+// The generated C is collected in units: one per function and one per
+// variable. Only the units reachable from main are written out.
+struct unit {
+    const char *forth_word; // name to list if dropped, or null
+    const char *c_name; // the function or variable that the code defines
+    int is_variable;
+    int is_thread_local; // a thread-variable
+    struct vec *code;
+    struct vec *uses; // indices of the units that the code refers to
+    struct vec *stack_events;
+    struct effect effects[3]; // for each value of flag at entry
+    int effect_states[3]; // 0 not worked out yet, 1 in progress, 2 done
+    int declared; // has a ( in -- out ) declaration
+    long declared_in;
+    long declared_out;
+    int quoted;
+    int live;
+    struct vec *writes; // names of the variables the function may store to
+    int writes_all; // it calls quoted words, which could store to any
+    size_t unchecked; // overflow checks that value ranges made unneeded
+    uint64_t hash; // of a colon definition and what it refers to, or 0
+    struct vec *quotes; // indices of the units whose words it quotes
+    struct vec *constants; // values pushed if it is a constant word
 };
 
 struct local {
     const char *forth_word;
     char *forth_word_setter;
     char *c_var_name;
+    size_t shadowed; // previous bindings of the names in local_table
+    size_t shadowed_setter;
+};
+
+// A value that the generated code keeps in a C expression (a constant, a
+// local or a temporary) instead of on the real data stack.
+struct entry {
+    char *expr;
+    int is_temp;
+    struct range range; // a constant if lo == hi
+    const char *origin; // local or variable whose value this is, or null
+};
+
+// An inlined body that can break out to its end.
+struct block {
+    struct vec *facts; // joined over its breaks, or null before the first
+    int flag_in_global; // at every break so far
+};
+
+// A range known for a local or variable at this point in the function.
+struct fact {
+    const char *name;
+    int is_variable;
+    struct range range;
+};
+
+// Code for a primitive in the x86-64 backend.
+struct asm_op {
+    const char *prim;
+    const char *code;
+    int direct; // the second operand can be a constant or in memory
+    int keeps_first; // the first operand stays on the stack
+    const char *cc; // condition code that flag is set from, or null
+    const char *ncc; // its negation
+    size_t cells; // how many cells it takes from the stack
+};
+
+// A value that the x86-64 backend holds back from the real stack.
+struct asm_item {
+    int kind;
+    uintptr_t value; // ASM_IMMEDIATE constant or ASM_LOCAL index
+    const char *name; // ASM_VARIABLE or ASM_ADDRESS symbol, ASM_REGISTER
 };
 
 static const char indent[] = "    ";
 
+// Shards refer to each other's functions and variables.
+static const char *linkage = "static ";
+
+static const struct range full_range = { 0, UINTPTR_MAX };
+
 static const char ascii[] = "0123456789"
                             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                             "abcdefghijklmnopqrstuvwxyz";
@@ -54,16 +309,425 @@ static const char ascii[] = "0123456789"
 static const char *mangle_one_char[] = { "=_equal", "@_fetch", "!_store",
     "+_plus", "*_star", "/_slash", "?_p", 0 };
 static const char *mangle_two_char[] = { "->_to_", 0 };
-static struct vec *mangle_pool;
+
+// Fold functions work out the range of an operator's result from the
+// ranges of its inputs. They fail if the generated code could die for some
+// of those inputs. A result with only one possible value is a constant.
+static int fold_add(const struct range *in, struct range *out)
+{
+    out->lo = in[0].lo + in[1].lo;
+    return !__builtin_add_overflow(in[0].hi, in[1].hi, &out->hi);
+}
+
+static int fold_sub(const struct range *in, struct range *out)
+{
+    if (in[0].lo < in[1].hi) {
+        return 0;
+    }
+    out->lo = in[0].lo - in[1].hi;
+    out->hi = in[0].hi - in[1].lo;
+    return 1;
+}
+
+// The values in a range are also a range of signed values unless it
+// crosses INTPTR_MAX.
+static int signed_range(const struct range *range, intptr_t *lo, intptr_t *hi)
+{
+    if ((range->lo <= INTPTR_MAX) != (range->hi <= INTPTR_MAX)) {
+        return 0;
+    }
+    *lo = (intptr_t)range->lo;
+    *hi = (intptr_t)range->hi;
+    return 1;
+}
+
+static int fold_sub_s(const struct range *in, struct range *out)
+{
+    intptr_t alo, ahi, blo, bhi, lo, hi;
+
+    if (!signed_range(&in[0], &alo, &ahi)
+        || !signed_range(&in[1], &blo, &bhi)
+        || __builtin_sub_overflow(alo, bhi, &lo)
+        || __builtin_sub_overflow(ahi, blo, &hi)) {
+        return 0;
+    }
+    if ((lo < 0) && (hi >= 0)) {
+        *out = full_range;
+    } else {
+        out->lo = (uintptr_t)lo;
+        out->hi = (uintptr_t)hi;
+    }
+    return 1;
+}
+
+static int fold_mul(const struct range *in, struct range *out)
+{
+    out->lo = in[0].lo * in[1].lo;
+    return !__builtin_mul_overflow(in[0].hi, in[1].hi, &out->hi);
+}
+
+static int fold_cells(const struct range *in, struct range *out)
+{
+    out->lo = in[0].lo * sizeof(uintptr_t);
+    return !__builtin_mul_overflow(in[0].hi, sizeof(uintptr_t), &out->hi);
+}
+
+static int fold_cells_plus(const struct range *in, struct range *out)
+{
+    struct range offset;
+
+    return fold_cells(&in[1], &offset)
+        && fold_add((struct range[]) { in[0], offset }, out);
+}
+
+static int fold_one_plus(const struct range *in, struct range *out)
+{
+    return fold_add((struct range[]) { in[0], { 1, 1 } }, out);
+}
+
+static int fold_one_minus(const struct range *in, struct range *out)
+{
+    return fold_sub((struct range[]) { in[0], { 1, 1 } }, out);
+}
+
+static uintptr_t min_uintptr(uintptr_t a, uintptr_t b)
+{
+    return (a < b) ? a : b;
+}
+
+static uintptr_t max_uintptr(uintptr_t a, uintptr_t b)
+{
+    return (a > b) ? a : b;
+}
+
+static int fold_and_bits(const struct range *in, struct range *out)
+{
+    out->lo = 0;
+    out->hi = min_uintptr(in[0].hi, in[1].hi);
+    if ((in[0].lo == in[0].hi) && (in[1].lo == in[1].hi)) {
+        out->lo = out->hi = in[0].lo & in[1].lo;
+    }
+    return 1;
+}
+
+static int fold_or_bits(const struct range *in, struct range *out)
+{
+    unsigned int shift;
+
+    out->lo = max_uintptr(in[0].lo, in[1].lo);
+    out->hi = max_uintptr(in[0].hi, in[1].hi);
+    for (shift = 1; shift < sizeof(uintptr_t) * CHAR_BIT; shift *= 2) {
+        out->hi |= out->hi >> shift;
+    }
+    if ((in[0].lo == in[0].hi) && (in[1].lo == in[1].hi)) {
+        out->lo = out->hi = in[0].lo | in[1].lo;
+    }
+    return 1;
+}
+
+static int fold_byte_fetch(const struct range *in, struct range *out)
+{
+    (void)in;
+    out->lo = 0;
+    out->hi = UINT8_MAX;
+    return 1;
+}
+
+static int fold_cell_bits(const struct range *in, struct range *out)
+{
+    (void)in;
+    out->lo = out->hi = sizeof(uintptr_t) * CHAR_BIT;
+    return 1;
+}
+
+static uintptr_t n_bits(uintptr_t x)
+{
+    uintptr_t n;
+
+    for (n = 0; x; x >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+static int fold_max_to_n_bits(const struct range *in, struct range *out)
+{
+    if (!in[0].lo) {
+        return 0;
+    }
+    out->lo = n_bits(in[0].lo);
+    out->hi = n_bits(in[0].hi);
+    return 1;
+}
+
+static int fold_n_bits_to_bitmask(const struct range *in, struct range *out)
+{
+    if (in[0].hi >= sizeof(uintptr_t) * CHAR_BIT) {
+        return 0;
+    }
+    out->lo = ((uintptr_t)1 << in[0].lo) - 1;
+    out->hi = ((uintptr_t)1 << in[0].hi) - 1;
+    return 1;
+}
+
+static const struct op operators[] = {
+    { "dup", 1, 0, 0, { "$1", "$1" }, 0, 0, 0 },
+    { "drop", 1, 0, 0, { 0, 0 }, 0, 0, 0 },
+    { "flag", 0, 0, 0, { "$f", 0 }, 0, 0, 0 },
+    { "<>", 2, 0, "$1 != $2", { "$1", 0 }, 0, 0, 0 },
+    { "=", 2, 0, "$1 == $2", { "$1", 0 }, 0, 0, 0 },
+    { "<", 2, 0, "$1 < $2", { "$1", 0 }, 0, 0, 0 },
+    { "<=", 2, 0, "$1 <= $2", { "$1", 0 }, 0, 0, 0 },
+    { ">", 2, 0, "$1 > $2", { "$1", 0 }, 0, 0, 0 },
+    { ">=", 2, 0, "$1 >= $2", { "$1", 0 }, 0, 0, 0 },
+    { ">=s", 2, 0, "(intptr_t)$1 >= (intptr_t)$2", { "$1", 0 }, 0, 0, 0 },
+    { "+", 2, 0, 0, { "checked_add($1, $2)", 0 }, 0, fold_add, "$1 + $2" },
+    { "-", 2, 0, 0, { "checked_sub($1, $2)", 0 }, 0, fold_sub, "$1 - $2" },
+    { "-s", 2, 0, 0, { "checked_sub_s($1, $2)", 0 }, 0, fold_sub_s,
+        "(uintptr_t)((intptr_t)$1 - (intptr_t)$2)" },
+    { "*", 2, 0, 0, { "checked_mul($1, $2)", 0 }, 0, fold_mul, "$1 * $2" },
+    { "cells", 1, 0, 0, { "checked_mul($1, sizeof(uintptr_t))", 0 }, 0,
+        fold_cells, "$1 * sizeof(uintptr_t)" },
+    { "@", 1, 0, 0, { "*(uintptr_t *)$1", 0 }, 0, 0, 0 },
+    { "!", 2, "*(uintptr_t *)$2 = $1;", 0, { 0, 0 }, 0, 0, 0 },
+    { "byte@", 1, 0, 0, { "*(uint8_t *)$1", 0 }, 0, fold_byte_fetch, 0 },
+    { "byte!", 2, "*(uint8_t *)$2 = (uint8_t)$1;", 0, { 0, 0 }, 0, 0, 0 },
+    { "and-bits", 2, 0, 0, { "$1 & $2", 0 }, 0, fold_and_bits, 0 },
+    { "or-bits", 2, 0, 0, { "$1 | $2", 0 }, 0, fold_or_bits, 0 },
+    { "cell-bits", 0, 0, 0, { "sizeof(uintptr_t) * CHAR_BIT", 0 }, 0,
+        fold_cell_bits, 0 },
+    { "max->n-bits", 1, 0, 0, { "max_to_n_bits($1)", 0 }, 0,
+        fold_max_to_n_bits, 0 },
+    { "n-bits->bitmask", 1, 0, 0, { "((uintptr_t)1 << $1) - 1", 0 }, 0,
+        fold_n_bits_to_bitmask, 0 },
+    { 0, 0, 0, 0, { 0, 0 }, 0, 0, 0 },
+};
+
+// Longer sequences must come before their prefixes.
+static struct fusion fusions[] = {
+    { { "1", "+", "cells", "+", "@", 0 },
+        { "1 + cells + @", 2, 0, 0,
+            { "*(uintptr_t *)checked_add($1, "
+              "checked_mul(checked_add($2, 1), sizeof(uintptr_t)))",
+                0 },
+            0, 0, 0 },
+        0 },
+    { { "1", "+", "cells", "+", "!", 0 },
+        { "1 + cells + !", 3,
+            "*(uintptr_t *)checked_add($2, "
+            "checked_mul(checked_add($3, 1), sizeof(uintptr_t))) = $1;",
+            0, { 0, 0 }, 0, 0, 0 },
+        0 },
+    { { "cells", "+", "@", 0 },
+        { "cells + @", 2, 0, 0,
+            { "*(uintptr_t *)checked_add($1, "
+              "checked_mul($2, sizeof(uintptr_t)))",
+                0 },
+            0, 0, 0 },
+        0 },
+    { { "cells", "+", "!", 0 },
+        { "cells + !", 3,
+            "*(uintptr_t *)checked_add($2, "
+            "checked_mul($3, sizeof(uintptr_t))) = $1;",
+            0, { 0, 0 }, 0, 0, 0 },
+        0 },
+    { { "cells", "+", 0 },
+        { "cells +", 2, 0, 0,
+            { "checked_add($1, checked_mul($2, sizeof(uintptr_t)))", 0 },
+            0, fold_cells_plus, "$1 + $2 * sizeof(uintptr_t)" },
+        0 },
+    { { "1", "+", 0 },
+        { "1 +", 1, 0, 0, { "checked_add($1, 1)", 0 }, 0, fold_one_plus,
+            "$1 + 1" },
+        0 },
+    { { "1", "-", 0 },
+        { "1 -", 1, 0, 0, { "checked_sub($1, 1)", 0 }, 0, fold_one_minus,
+            "$1 - 1" },
+        0 },
+    { { "dup", "@", 0 },
+        { "dup @", 1, 0, 0, { "$1", "*(uintptr_t *)$1" }, 0, 0, 0 }, 0 },
+    { { "<", "drop", "&", 0 },
+        { "< drop &", 2, 0, "$1 < $2", { 0, 0 }, '&', 0, 0 }, 0 },
+    { { "=", "drop", "&", 0 },
+        { "= drop &", 2, 0, "$1 == $2", { 0, 0 }, '&', 0, 0 }, 0 },
+    { { "<>", "&", 0 },
+        { "<> &", 2, 0, "$1 != $2", { "$1", 0 }, '&', 0, 0 }, 0 },
+    { { "=", "&", 0 },
+        { "= &", 2, 0, "$1 == $2", { "$1", 0 }, '&', 0, 0 }, 0 },
+    { { "<", "&", 0 },
+        { "< &", 2, 0, "$1 < $2", { "$1", 0 }, '&', 0, 0 }, 0 },
+    { { "<=", "&", 0 },
+        { "<= &", 2, 0, "$1 <= $2", { "$1", 0 }, '&', 0, 0 }, 0 },
+    { { ">", "&", 0 },
+        { "> &", 2, 0, "$1 > $2", { "$1", 0 }, '&', 0, 0 }, 0 },
+    { { ">=", "&", 0 },
+        { ">= &", 2, 0, "$1 >= $2", { "$1", 0 }, '&', 0, 0 }, 0 },
+    { { ">=s", "&", 0 },
+        { ">=s &", 2, 0, "(intptr_t)$1 >= (intptr_t)$2", { "$1", 0 }, '&',
+            0, 0 },
+        0 },
+    { { "<>", "|", 0 },
+        { "<> |", 2, 0, "$1 != $2", { "$1", 0 }, '|', 0, 0 }, 0 },
+    { { "=", "|", 0 },
+        { "= |", 2, 0, "$1 == $2", { "$1", 0 }, '|', 0, 0 }, 0 },
+    { { "<", "|", 0 },
+        { "< |", 2, 0, "$1 < $2", { "$1", 0 }, '|', 0, 0 }, 0 },
+    { { ">", "|", 0 },
+        { "> |", 2, 0, "$1 > $2", { "$1", 0 }, '|', 0, 0 }, 0 },
+    { { "<=", "|", 0 },
+        { "<= |", 2, 0, "$1 <= $2", { "$1", 0 }, '|', 0, 0 }, 0 },
+    { { ">=", "|", 0 },
+        { ">= |", 2, 0, "$1 >= $2", { "$1", 0 }, '|', 0, 0 }, 0 },
+    { { ">=s", "|", 0 },
+        { ">=s |", 2, 0, "(intptr_t)$1 >= (intptr_t)$2", { "$1", 0 }, '|',
+            0, 0 },
+        0 },
+    { { 0 }, { 0, 0, 0, 0, { 0, 0 }, 0, 0, 0 }, 0 },
+};
+
+// What a comparison being true or false says about the ranges of its
+// inputs.
+static void refine_lt(struct range *a, struct range *b)
+{
+    if (b->hi) {
+        a->hi = min_uintptr(a->hi, b->hi - 1);
+    }
+    if (a->lo != UINTPTR_MAX) {
+        b->lo = max_uintptr(b->lo, a->lo + 1);
+    }
+}
+
+static void refine_le(struct range *a, struct range *b)
+{
+    a->hi = min_uintptr(a->hi, b->hi);
+    b->lo = max_uintptr(b->lo, a->lo);
+}
+
+static void refine_gt(struct range *a, struct range *b) { refine_lt(b, a); }
+
+static void refine_ge(struct range *a, struct range *b) { refine_le(b, a); }
+
+static void refine_eq(struct range *a, struct range *b)
+{
+    refine_le(a, b);
+    refine_ge(a, b);
+}
+
+// A value that is not less than a non-negative one is non-negative too.
+static void refine_ge_s(struct range *a, struct range *b)
+{
+    if (b->hi <= INTPTR_MAX) {
+        a->lo = max_uintptr(a->lo, b->lo);
+        a->hi = min_uintptr(a->hi, INTPTR_MAX);
+    }
+}
+
+static const struct guard guards[] = {
+    { "$1 != $2", 0, refine_eq },
+    { "$1 == $2", refine_eq, 0 },
+    { "$1 < $2", refine_lt, refine_ge },
+    { "$1 <= $2", refine_le, refine_gt },
+    { "$1 > $2", refine_gt, refine_le },
+    { "$1 >= $2", refine_ge, refine_lt },
+    { "(intptr_t)$1 >= (intptr_t)$2", refine_ge_s, 0 },
+    { 0, 0, 0 },
+};
+
+static struct table *mangle_pool; // generated name -> 1
+static struct table *mangle_suffixes; // base name -> last suffix tried
+static struct table *local_pool; // the same for locals, per function
+static struct table *local_suffixes;
 static struct vec *definitions;
+static struct vec *units;
+static struct table *unit_names; // C name -> unit index + 1
+static size_t current_unit;
+static struct vec *output; // code of the current unit
+static struct table *dictionary; // word -> definition index + 1
 static struct vec *locals;
+static struct table *local_table; // word -> 2 * (local index + 1) + setter
+static size_t locals_base;
+static size_t current_definition;
+static size_t generation;
+static size_t inline_threshold = 8;
+static int tail_recursive;
+static struct vec *vstack;
+static size_t ntemp;
+static size_t nlabel;
+static size_t depth;
+static const char *exit_statement;
+static const char *return_statement = "return;";
+static size_t tail_call_start; // where the last call to a word starts
+static size_t tail_call_end = SIZE_MAX; // and ends
+static const char *tail_call_name;
+static struct vec *facts;
+static struct vec *open_blocks;
+static size_t flag_decl_pos; // where lflag is declared if it is used
+static struct vec *exit_counters; // declarations of the -p exit counters
+static size_t nexit;
+static int flag_used;
+static int flag_read;
+static int flag_in_local; // lflag holds the current value of flag
+static int flag_in_global; // the global flag does
+static struct vec *image; // threaded code, with -t
+static size_t frame_size; // locals in the threaded word being compiled
+static struct token *line_directive_token; // #line to write before code
+static struct table *asm_names; // C names the assembly has wrapped
+static struct asm_item asm_held[MAX_HELD];
+static size_t asm_nheld;
+static int asm_check_pops; // the depth of the stack is not verified
+static const char *asm_loop_vars[ASM_LOOP_VAR_REGS]; // of the next tail loop
+static size_t asm_nloop_vars;
+static int asm_in_loop; // the loop's variables are in registers
+static struct vec *asm_exits; // returns of the current word, placed after it
+static size_t asm_nexit;
+static int asm_flag = -1; // the value of flag if %r13 does not have it yet
 
 static struct token token_eof = { .tag = TOK_EOF };
 static struct vec *tokens;
 static size_t tokens_pos;
 
+static int option_report;
+static int option_stats;
+static int option_global_flag;
+static long option_max_stack;
+static int option_list_dropped;
+static int option_tokenize_benchmark;
+static int option_threaded;
+static int option_asm;
+static int option_line_directives;
+static int option_profile;
+static int option_registers;
+static const char *option_symbol_map;
+static const char *option_use_profile;
+static const char *option_cache;
+static const char *option_output;
+static size_t option_shards;
+
+static const char *cache; // contents of the cache file from the last run
+static uint64_t compiler_hash; // of the forthc executable that is running
+static size_t cache_len;
+static size_t cache_pos;
+static struct table *cache_index; // hash in hex -> offset of entry + 1
+static size_t ncached;
+
+static struct table *word_profiles; // word -> index in profiles + 1
+static struct table *exit_profiles; // "line:column" -> index + 1
+static struct vec *word_profile_counts;
+static struct vec *exit_profile_counts;
+static uint64_t profile_all_calls;
+static uint64_t profile_all_self;
+
+static const char *source_name = SOURCE;
+static struct vec *symbol_map; // contents of the -m file
 static size_t source_pos;
-static struct vec *source;
+static const char *source;
+static size_t source_len;
+static const struct scanner *scanner;
+static int uses_threads; // the program uses spawn or thread-variable
+static size_t block_start = SIZE_MAX;
+static uint64_t block_stops[3];
+static unsigned char char_classes[256];
+static unsigned char digit_values[256];
 
 static void panic(const char *s) __attribute__((__noreturn__));
 static void panic1(const char *s1, const char *s2)
@@ -81,9 +745,12 @@ static void panic1(const char *s1, const char *s2)
     exit(2);
 }
 
+static size_t nallocation; // for -b
+
 static void *zeroalloc(size_t nbyte)
 {
     void *p = calloc(nbyte, 1);
+    nallocation++;
     if (!p)
         panic("out of memory");
     return p;
@@ -155,12 +822,22 @@ static void *vec_reserve(struct vec *vec, size_t nitem)
         if (!(vec->bytes = realloc(vec->bytes, vec->cap * vec->itemsize))) {
             panic("out of memory");
         }
+        nallocation++;
     }
     void *p = vec->bytes + vec->len * vec->itemsize;
     vec->len += nitem;
     return p;
 }
 
+static void vec_insert(struct vec *vec, size_t pos, const char *str)
+{
+    size_t n = strlen(str);
+
+    vec_reserve(vec, n);
+    memmove(vec->bytes + pos + n, vec->bytes + pos, vec->len - n - pos);
+    memcpy(vec->bytes + pos, str, n);
+}
+
 static void vec_putb(struct vec *vec, const char *bytes, size_t n)
 {
     memcpy(vec_reserve(vec, n), bytes, n);
@@ -173,138 +850,510 @@ static void vec_puts(struct vec *vec, const char *str)
     vec_putb(vec, str, strlen(str));
 }
 
-static void vec_putd(struct vec *vec, int n)
+static void vec_putd(struct vec *vec, size_t n)
 {
-    char s[16];
-    snprintf(s, sizeof(s), "%d", n);
+    char s[24];
+    snprintf(s, sizeof(s), "%zu", n);
     vec_puts(vec, s);
 }
 
-static void display(const char *str) { printf("%s", str); }
+static size_t hash_span(const char *str, size_t len)
+{
+    size_t hash = 2166136261u;
 
-static void displayln(const char *str) { printf("%s\n", str); }
+    for (; len; len--, str++) {
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    }
+    return hash;
+}
 
-static void display_uintptr(uintptr_t u) { printf("%" PRIuPTR, u); }
+static int span_equals(const char *span, size_t len, const char *str)
+{
+    return !strncmp(span, str, len) && !str[len];
+}
 
-static void newline(void) { printf("\n"); }
+static struct table *table_new(void)
+{
+    struct table *table = zeroalloc(sizeof(*table));
+    table->cap = 64;
+    table->slots = zeroalloc(table->cap * sizeof(*table->slots));
+    return table;
+}
 
-static void slurp(void)
+static void table_clear(struct table *table)
 {
-    const size_t chunk_cap = 512;
-    char *chunk;
-    FILE *input;
-    size_t empty, chunk_len;
+    size_t i;
 
-    if (!(input = fopen(SOURCE, "rb"))) {
-        panic("cannot open " SOURCE);
+    for (i = 0; i < table->cap; i++) {
+        free(table->slots[i].key);
     }
-    do {
-        chunk = vec_reserve(source, chunk_cap);
-        chunk_len = fread(chunk, 1, chunk_cap, input);
-        if (ferror(input)) {
-            panic("cannot read from file");
+    memset(table->slots, 0, table->cap * sizeof(*table->slots));
+    table->len = 0;
+}
+
+static struct slot *table_slot(
+    struct table *table, const char *key, size_t len)
+{
+    struct slot *slot;
+    size_t i;
+
+    i = hash_span(key, len);
+    for (;;) {
+        slot = &table->slots[i & (table->cap - 1)];
+        if (!slot->key || span_equals(key, len, slot->key)) {
+            return slot;
         }
-        empty = chunk_cap - chunk_len;
-    } while (!empty);
-    source->len -= empty;
-    if (fclose(input) != 0) {
-        panic("cannot close file");
+        i++;
     }
-    if (memchr(source->bytes, 0, source->len)) {
-        panic("source code contains null byte");
+}
+
+static void table_grow(struct table *table)
+{
+    struct slot *old_slots = table->slots;
+    size_t old_cap = table->cap;
+    size_t i;
+
+    table->cap *= 2;
+    table->slots = zeroalloc(table->cap * sizeof(*table->slots));
+    for (i = 0; i < old_cap; i++) {
+        if (old_slots[i].key) {
+            *table_slot(table, old_slots[i].key, strlen(old_slots[i].key))
+                = old_slots[i];
+        }
     }
+    free(old_slots);
 }
 
-static int read_char_if(int (*predicate)(int))
+// Values are never removed, only set back to 0, which means "none".
+static size_t table_get_span(struct table *table, const char *key, size_t len)
 {
-    if (source_pos >= source->len) {
-        return 0;
+    return table_slot(table, key, len)->value;
+}
+
+static size_t table_get(struct table *table, const char *key)
+{
+    return table_get_span(table, key, strlen(key));
+}
+
+static char *table_put(struct table *table, const char *key, size_t value)
+{
+    struct slot *slot;
+    size_t len = strlen(key);
+
+    if (2 * (table->len + 1) > table->cap) {
+        table_grow(table);
     }
-    if (!predicate(source->bytes[source_pos])) {
-        return 0;
+    slot = table_slot(table, key, len);
+    if (!slot->key) {
+        slot->key = copy_string_span(key, key + len);
+        table->len++;
     }
-    return source->bytes[source_pos++];
+    slot->value = value;
+    return slot->key;
 }
 
-static int read_the_char(int ch)
+// With -l the C compiler attributes the code that follows a #line
+// directive to the given line, so that debuggers and profilers show the
+// Forth source. The count drifts over the lines that one token compiles
+// into, so each token that compiles into code gets a directive of its own,
+// written when the code starts.
+static void display_line_directive(struct token *tok)
 {
-    if (source_pos >= source->len) {
-        return 0;
+    if (option_line_directives && (tok->tag != TOK_EOF)) {
+        line_directive_token = tok;
     }
-    if (source->bytes[source_pos] != ch) {
-        return 0;
-    }
-    return source->bytes[source_pos++];
 }
 
-static int is_word_char(int ch)
+static void vec_put_c_string(struct vec *out, const char *str)
 {
-    return (!isspace(ch)) && (ch != '"') && (ch != '#');
+    vec_putc(out, '"');
+    for (; *str; str++) {
+        if ((*str == '"') || (*str == '\\')) {
+            vec_putc(out, '\\');
+        }
+        vec_putc(out, *str);
+    }
+    vec_putc(out, '"');
 }
 
-static int is_string_char(int ch) { return isprint(ch) && (ch != '"'); }
+static void flush_line_directive(void)
+{
+    char s[24];
 
-static int is_horizontal_char(int ch) { return ch != '\n'; }
+    if (!line_directive_token
+        || (output->len && (output->bytes[output->len - 1] != '\n'))) {
+        return;
+    }
+    snprintf(s, sizeof(s), "%zu", line_directive_token->line);
+    line_directive_token = 0;
+    vec_puts(output, "#line ");
+    vec_puts(output, s);
+    vec_putc(output, ' ');
+    vec_put_c_string(output, source_name);
+    vec_putc(output, '\n');
+}
 
-static int token_is_word(struct token *tok, const char *word)
+static void display(const char *str)
 {
-    if (tok->tag != TOK_WORD)
-        return 0;
-    return !strcmp(tok->string, word);
+    flush_line_directive();
+    vec_puts(output, str);
 }
 
-static struct token *allocate_token(size_t tag)
+static void displayln(const char *str)
 {
-    struct token *tok;
+    flush_line_directive();
+    vec_puts(output, str);
+    vec_putc(output, '\n');
+}
 
-    tok = vec_reserve(tokens, 1);
-    tok->tag = tag;
-    return tok;
+static void display_uintptr(uintptr_t u)
+{
+    char s[24];
+    snprintf(s, sizeof(s), "%" PRIuPTR, u);
+    flush_line_directive();
+    vec_puts(output, s);
 }
 
-static void skip_whitespace(void)
+static void newline(void)
 {
-    while (read_char_if(isspace))
-        ;
+    flush_line_directive();
+    vec_putc(output, '\n');
 }
 
-static void skip_rest_of_line(void)
+static void display_indent(void)
 {
-    while (read_char_if(is_horizontal_char))
-        ;
+    size_t i;
+
+    for (i = 0; i < depth; i++) {
+        display(indent);
+    }
 }
 
-static void read_string_token(void)
+// With -r, words take and return the stack pointer, the top of the stack
+// and flag, which forth.h unpacks into the locals sp, tos and lflag.
+static void display_function_start(const char *c_func_name)
 {
-    struct token *tok;
+    display(linkage);
+    if (option_registers) {
+        display("forth_regs ");
+        display(c_func_name);
+        displayln("(forth_regs regs) {");
+        display(indent);
+        displayln("FORTH_ENTER();");
+        return;
+    }
+    display("void ");
+    display(c_func_name);
+    displayln("(void) {");
+}
 
-    source->mark = source_pos;
-    while (!read_the_char('"')) {
-        if (read_char_if(is_string_char)) {
-            ;
-        } else {
-            panic("Syntax error inside string");
+// Returns null if the file cannot be opened.
+static const char *map_file(const char *name, size_t *out_len)
+{
+    const char *contents = "";
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) == -1) {
+        return 0;
+    }
+    if (fstat(fd, &st) == -1) {
+        panic("cannot read from file");
+    }
+    *out_len = (size_t)st.st_size;
+    if (*out_len) {
+        map = mmap(0, *out_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            panic("cannot read from file");
         }
+        contents = map;
     }
-    tok = allocate_token(TOK_STRING);
-    tok->string = copy_string_span((char *)source->bytes + source->mark,
-        (char *)source->bytes + source_pos - 1);
+    if (close(fd) == -1) {
+        panic("cannot close file");
+    }
+    return contents;
 }
 
-static int parse_number(const char *str, const char *limit, struct token *tok)
+// Files are only replaced when their contents change, so that the build
+// does not redo the work that depends on them.
+static void write_file_if_changed(const char *name, struct vec *contents)
 {
-    const char digits[] = "0123456789abcdef";
-    const char *digitp;
-    uintptr_t digit, value;
-    size_t base = 10;
-    int is_negative;
+    const char *old;
+    size_t old_len;
+    char *tmp_name;
+    FILE *file;
 
-    value = 0;
-    is_negative = (str[0] == '-');
-    if (is_negative) {
-        str++;
+    old = map_file(name, &old_len);
+    if (old && (old_len == contents->len)
+        && !memcmp(old, contents->bytes, old_len)) {
+        return;
     }
-    if (str[0] == '0') {
+    tmp_name = copy_two_strings(name, ".new");
+    if (!(file = fopen(tmp_name, "wb"))) {
+        panic1("cannot open", tmp_name);
+    }
+    if ((fwrite(contents->bytes, 1, contents->len, file) != contents->len)
+        || fclose(file)) {
+        panic1("cannot write to", tmp_name);
+    }
+    if (rename(tmp_name, name) == -1) {
+        panic1("cannot rename", tmp_name);
+    }
+    free(tmp_name);
+}
+
+// The source stays mapped until the compiler exits, so tokens can point
+// into it instead of holding copies.
+static void slurp(void)
+{
+    if (!(source = map_file(source_name, &source_len))) {
+        panic1("cannot open", source_name);
+    }
+    if (memchr(source, 0, source_len)) {
+        panic("source code contains null byte");
+    }
+}
+
+static int token_is_word(struct token *tok, const char *word)
+{
+    if (tok->tag != TOK_WORD)
+        return 0;
+    return span_equals(tok->string, tok->length, word);
+}
+
+// Whether the program needs the runtime built with FORTH_THREADS.
+static int find_thread_words(void)
+{
+    size_t i;
+
+    for (i = 0; i < tokens->len; i++) {
+        if (token_is_word(vec_get(tokens, i), "spawn")
+            || token_is_word(vec_get(tokens, i), "thread-variable")) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static char *token_string(struct token *tok)
+{
+    return copy_string_span(tok->string, tok->string + tok->length);
+}
+
+static struct token *allocate_token(size_t tag)
+{
+    struct token *tok;
+
+    tok = vec_reserve(tokens, 1);
+    tok->tag = tag;
+    return tok;
+}
+
+// Character classes are fixed to the C locale so that the scalar and the
+// vector scanners agree on every byte.
+static void init_char_classes(void)
+{
+    const char digits[] = "0123456789abcdef";
+    size_t ch;
+
+    for (ch = 0; ch < 256; ch++) {
+        if (((ch >= '\t') && (ch <= '\r')) || (ch == ' ')) {
+            char_classes[ch] |= CHAR_SPACE | CHAR_WORD_END;
+        }
+        if ((ch == '"') || (ch == '#')) {
+            char_classes[ch] |= CHAR_WORD_END;
+        }
+        if ((ch < ' ') || (ch > '~') || (ch == '"')) {
+            char_classes[ch] |= CHAR_STRING_END;
+        }
+        digit_values[ch] = 0xff;
+    }
+    for (ch = 0; digits[ch]; ch++) {
+        digit_values[(unsigned char)digits[ch]] = (unsigned char)ch;
+    }
+}
+
+// Set the stop bits of all three kinds of scan for the n bytes at p.
+static void classify_scalar(const char *p, size_t n, uint64_t stops[3])
+{
+    unsigned char classes;
+    uint64_t bit;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        classes = char_classes[(unsigned char)p[i]];
+        bit = (uint64_t)1 << i;
+        if (!(classes & CHAR_SPACE)) {
+            stops[SCAN_SPACES] |= bit;
+        }
+        if (classes & CHAR_WORD_END) {
+            stops[SCAN_WORD] |= bit;
+        }
+        if (classes & CHAR_STRING_END) {
+            stops[SCAN_STRING] |= bit;
+        }
+    }
+}
+
+static void classify_block_scalar(const char *p, uint64_t stops[3])
+{
+    classify_scalar(p, BLOCK_SIZE, stops);
+}
+
+#ifdef __SSE2__
+// Whitespace is ' ' or '\t'..'\r', and printable is ' '..'~'. SSE2 has no
+// unsigned byte comparison, so x <= n is computed as min(x, n) == x.
+static void classify_block_sse2(const char *p, uint64_t stops[3])
+{
+    __m128i bytes, tab, space, quote, print;
+    size_t i;
+
+    for (i = 0; i < BLOCK_SIZE; i += 16) {
+        bytes = _mm_loadu_si128((const void *)(p + i));
+        tab = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+        space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+            _mm_cmpeq_epi8(_mm_min_epu8(tab, _mm_set1_epi8(4)), tab));
+        quote = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'));
+        print = _mm_sub_epi8(bytes, _mm_set1_epi8(' '));
+        print = _mm_cmpeq_epi8(
+            _mm_min_epu8(print, _mm_set1_epi8('~' - ' ')), print);
+        stops[SCAN_SPACES]
+            |= (uint64_t)(~_mm_movemask_epi8(space) & 0xffff) << i;
+        stops[SCAN_WORD] |= (uint64_t)_mm_movemask_epi8(_mm_or_si128(
+                                _mm_or_si128(space, quote),
+                                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('#'))))
+            << i;
+        stops[SCAN_STRING] |= (uint64_t)(~_mm_movemask_epi8(print) & 0xffff)
+            << i;
+        stops[SCAN_STRING] |= (uint64_t)_mm_movemask_epi8(quote) << i;
+    }
+}
+
+__attribute__((__target__("avx2"))) static void classify_block_avx2(
+    const char *p, uint64_t stops[3])
+{
+    __m256i bytes, tab, space, quote, print;
+    size_t i;
+
+    for (i = 0; i < BLOCK_SIZE; i += 32) {
+        bytes = _mm256_loadu_si256((const void *)(p + i));
+        tab = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+        space = _mm256_or_si256(
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+            _mm256_cmpeq_epi8(
+                _mm256_min_epu8(tab, _mm256_set1_epi8(4)), tab));
+        quote = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"'));
+        print = _mm256_sub_epi8(bytes, _mm256_set1_epi8(' '));
+        print = _mm256_cmpeq_epi8(
+            _mm256_min_epu8(print, _mm256_set1_epi8('~' - ' ')), print);
+        stops[SCAN_SPACES]
+            |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(space) << i;
+        stops[SCAN_WORD]
+            |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+                   _mm256_or_si256(space, quote),
+                   _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('#'))))
+            << i;
+        stops[SCAN_STRING]
+            |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(print) << i;
+        stops[SCAN_STRING]
+            |= (uint64_t)(uint32_t)_mm256_movemask_epi8(quote) << i;
+    }
+}
+#endif
+
+static const struct scanner scanners[] = {
+#ifdef __SSE2__
+    { "avx2", classify_block_avx2 },
+    { "sse2", classify_block_sse2 },
+#endif
+    { "scalar", classify_block_scalar },
+};
+
+static int scanner_is_supported(const struct scanner *candidate)
+{
+#ifdef __SSE2__
+    if (candidate->classify_block == classify_block_avx2) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)candidate;
+    return 1;
+}
+
+static void choose_scanner(void)
+{
+    scanner = scanners;
+    while (!scanner_is_supported(scanner)) {
+        scanner++;
+    }
+}
+
+// The last partial block is classified byte by byte, and every position
+// past the end of the source is a stop for every kind of scan.
+static void load_block(size_t start)
+{
+    size_t n = source_len - start;
+
+    memset(block_stops, 0, sizeof(block_stops));
+    if (n >= BLOCK_SIZE) {
+        scanner->classify_block(source + start, block_stops);
+    } else {
+        classify_scalar(source + start, n, block_stops);
+        block_stops[SCAN_SPACES] |= ~(uint64_t)0 << n;
+        block_stops[SCAN_WORD] |= ~(uint64_t)0 << n;
+        block_stops[SCAN_STRING] |= ~(uint64_t)0 << n;
+    }
+    block_start = start;
+}
+
+// Return the position of the first byte at or after pos where the scan
+// stops, or source_len if there is none.
+static size_t scan(size_t pos, int kind)
+{
+    uint64_t stops;
+
+    while (pos < source_len) {
+        if ((pos & ~(size_t)(BLOCK_SIZE - 1)) != block_start) {
+            load_block(pos & ~(size_t)(BLOCK_SIZE - 1));
+        }
+        stops = block_stops[kind] >> (pos - block_start);
+        if (stops) {
+            return pos + (size_t)__builtin_ctzll(stops);
+        }
+        pos = block_start + BLOCK_SIZE;
+    }
+    return source_len;
+}
+
+static void read_string_token(void)
+{
+    struct token *tok;
+    size_t start;
+
+    start = source_pos;
+    source_pos = scan(source_pos, SCAN_STRING);
+    if ((source_pos == source_len) || (source[source_pos] != '"')) {
+        panic("Syntax error inside string");
+    }
+    tok = allocate_token(TOK_STRING);
+    tok->string = source + start;
+    tok->length = source_pos++ - start;
+}
+
+static int parse_number(const char *str, const char *limit, struct token *tok)
+{
+    uintptr_t digit, value;
+    size_t base = 10;
+    int is_negative;
+
+    value = 0;
+    is_negative = (str[0] == '-');
+    if (is_negative) {
+        str++;
+    }
+    if ((limit - str >= 2) && (str[0] == '0')) {
         if (str[1] == 'b') {
             base = 2;
             str += 2;
@@ -316,11 +1365,11 @@ static int parse_number(const char *str, const char *limit, struct token *tok)
             str += 2;
         }
     }
+    if (str == limit) {
+        return 0;
+    }
     while (str < limit) {
-        if (!(digitp = strchr(digits, *str++))) {
-            return 0;
-        }
-        digit = (uintptr_t)(digitp - digits);
+        digit = digit_values[(unsigned char)*str++];
         if (digit >= base) {
             return 0;
         }
@@ -335,34 +1384,63 @@ static int parse_number(const char *str, const char *limit, struct token *tok)
 static void read_word_token_or_panic(void)
 {
     struct token *tok;
+    size_t start;
 
-    source->mark = source_pos;
-    while (read_char_if(is_word_char))
-        ;
-    if (source->mark == source_pos) {
+    start = source_pos;
+    source_pos = scan(source_pos, SCAN_WORD);
+    if (start == source_pos) {
         panic("Syntax error at top level");
     }
     tok = allocate_token(TOK_WORD);
-    tok->string = copy_string_span((char *)source->bytes + source->mark,
-        (char *)source->bytes + source_pos);
-    parse_number((char *)source->bytes + source->mark,
-                 (char *)source->bytes + source_pos, tok);
+    tok->string = source + start;
+    tok->length = source_pos - start;
+    parse_number(source + start, source + source_pos, tok);
+}
+
+// Lines are counted after tokenizing so that the scanners do not have to
+// look for newlines.
+static void number_lines(void)
+{
+    const char *line_start = source;
+    const char *p = source;
+    const char *start, *newline;
+    struct token *tok;
+    size_t line = 1;
+    size_t i;
+
+    for (i = 0; i < tokens->len; i++) {
+        tok = vec_get(tokens, i);
+        start = tok->string - (tok->tag == TOK_STRING);
+        while ((newline = memchr(p, '\n', (size_t)(start - p)))) {
+            line++;
+            p = line_start = newline + 1;
+        }
+        p = start;
+        tok->line = line;
+        tok->column = (size_t)(start - line_start) + 1;
+    }
 }
 
 static void tokenize(void)
 {
+    const char *newline;
+
     for (;;) {
-        skip_whitespace();
-        if (source_pos == source->len) {
+        source_pos = scan(source_pos, SCAN_SPACES);
+        if (source_pos == source_len) {
             break;
-        } else if (read_the_char('\\')) {
-            skip_rest_of_line();
-        } else if (read_the_char('"')) {
+        } else if (source[source_pos] == '\\') {
+            newline = memchr(
+                source + source_pos, '\n', source_len - source_pos);
+            source_pos = newline ? (size_t)(newline - source) : source_len;
+        } else if (source[source_pos] == '"') {
+            source_pos++;
             read_string_token();
         } else {
             read_word_token_or_panic();
         }
     }
+    number_lines();
 }
 
 static struct token *read_token(size_t tag_bits)
@@ -398,37 +1476,17 @@ static struct token *read_the_word(const char *word)
     return tok;
 }
 
-static int mangle_pool_contains(const char *mangled)
-{
-    const char **sp;
-    const char *s;
-    size_t i;
-
-    for (i = 0; i < mangle_pool->len; i++) {
-        sp = vec_get(mangle_pool, i);
-        s = *sp;
-        if (!strcmp(mangled, s)) {
-            return 1;
-        }
-    }
-    return 0;
-}
-
-static char *mangle_pool_add(const char *mangled)
-{
-    char **mangledp;
-
-    mangledp = vec_reserve(mangle_pool, 1);
-    *mangledp = copy_string(mangled);
-    return *mangledp;
-}
-
-static char *mangle(const char *prefix, const char *forth_word)
+// The pool remembers every name generated so far and, for each base name,
+// the last numeric suffix that was tried, so that finding a free name
+// does not start over from _1.
+static char *mangle_in(struct table *pool, struct table *suffixes,
+    const char *prefix, const char *forth_word)
 {
     const char *entry;
     const char **entryp;
     struct vec *mangled;
-    int n;
+    char *base;
+    size_t n;
 
     mangled = vec_new(sizeof(char));
     vec_puts(mangled, prefix);
@@ -456,30 +1514,48 @@ static char *mangle(const char *prefix, const char *forth_word)
     }
     vec_mark(mangled);
     vec_putc(mangled, 0);
-    n = 0;
-    while (mangle_pool_contains((char *)mangled->bytes)) {
+    base = copy_string((char *)mangled->bytes);
+    n = table_get(suffixes, base);
+    while (table_get(pool, (char *)mangled->bytes)) {
         vec_clear_to_mark(mangled);
         vec_putc(mangled, '_');
         vec_putd(mangled, ++n);
         vec_putc(mangled, 0);
     }
-    return mangle_pool_add((char *)mangled->bytes);
+    table_put(suffixes, base, n);
+    free(base);
+    return table_put(pool, (char *)mangled->bytes, 1);
 }
 
-static struct definition *lookup(const char *forth_word, size_t required_tag)
+static char *mangle(const char *prefix, const char *forth_word)
 {
-    size_t i = definitions->len;
-    while (i) {
-        struct definition *def = vec_get(definitions, --i);
-        if (strcmp(def->forth_word, forth_word)) {
-            continue;
-        }
-        if ((def->tag & required_tag) != required_tag) {
-            panic1("definition is not of the expected type:", forth_word);
-        }
-        return def;
+    return mangle_in(mangle_pool, mangle_suffixes, prefix, forth_word);
+}
+
+static struct definition *lookup_span(
+    const char *forth_word, size_t len, size_t required_tag)
+{
+    struct definition *def;
+    size_t i;
+
+    if (!(i = table_get_span(dictionary, forth_word, len))) {
+        return 0;
     }
-    return 0;
+    def = vec_get(definitions, i - 1);
+    if ((def->tag & required_tag) != required_tag) {
+        panic1("definition is not of the expected type:", def->forth_word);
+    }
+    return def;
+}
+
+static struct definition *lookup(const char *forth_word, size_t required_tag)
+{
+    return lookup_span(forth_word, strlen(forth_word), required_tag);
+}
+
+static struct definition *lookup_token(struct token *tok, size_t required_tag)
+{
+    return lookup_span(tok->string, tok->length, required_tag);
 }
 
 static struct definition *allocate_definition(const char *forth_word)
@@ -487,13 +1563,69 @@ static struct definition *allocate_definition(const char *forth_word)
     struct definition *def;
 
     def = lookup(forth_word, 0);
-    if (!def)
+    if (!def) {
         def = vec_reserve(definitions, 1);
+        table_put(dictionary, forth_word, definitions->len);
+    }
     memset(def, 0, sizeof(*def));
     def->forth_word = forth_word;
+    def->generation = ++generation;
     return def;
 }
 
+static size_t definition_index(struct definition *def)
+{
+    return (size_t)((unsigned char *)def - definitions->bytes)
+        / definitions->itemsize;
+}
+
+static size_t begin_unit(const char *forth_word, const char *c_name)
+{
+    struct unit *unit = vec_reserve(units, 1);
+
+    memset(unit, 0, sizeof(*unit));
+    unit->forth_word = forth_word;
+    unit->c_name = c_name;
+    unit->code = vec_new(sizeof(char));
+    unit->uses = vec_new(sizeof(size_t));
+    unit->stack_events = vec_new(sizeof(struct stack_event));
+    unit->writes = vec_new(sizeof(char *));
+    unit->quotes = vec_new(sizeof(size_t));
+    table_put(unit_names, c_name, units->len);
+    current_unit = units->len - 1;
+    output = unit->code;
+    return units->len;
+}
+
+static void use_unit(size_t unit)
+{
+    struct unit *current = vec_get(units, current_unit);
+
+    if (unit) {
+        *(size_t *)vec_reserve(current->uses, 1) = unit - 1;
+    }
+}
+
+// The quoted word can be called through its address from anywhere.
+static void quote_unit(size_t unit)
+{
+    struct unit *current = vec_get(units, current_unit);
+
+    ((struct unit *)vec_get(units, unit - 1))->quoted = 1;
+    *(size_t *)vec_reserve(current->quotes, 1) = unit - 1;
+}
+
+static struct stack_event *record_stack_event(int kind, long arg)
+{
+    struct unit *unit = vec_get(units, current_unit);
+    struct stack_event *event = vec_reserve(unit->stack_events, 1);
+
+    event->kind = kind;
+    event->flag = 0;
+    event->arg = arg;
+    return event;
+}
+
 static void define_compile_top_level(
     const char *forth_word, void (*compile)(void))
 {
@@ -509,36 +1641,101 @@ static void define_compile(const char *forth_word, void (*compile)(void))
     def->compile = compile;
 }
 
-static void define_primitive(const char *forth_word, const char *c_func_name)
+static void define_primitive(const char *forth_word, const char *c_func_name,
+    size_t nin, size_t nout, int sets_flag)
 {
     struct definition *def = allocate_definition(forth_word);
+    const struct op *op;
+
     def->tag = DEF_PRIMITIVE;
     def->c_func_name = copy_string(c_func_name);
+    def->nin = nin;
+    def->nout = nout;
+    def->sets_flag = sets_flag;
+    for (op = operators; op->forth_word; op++) {
+        if (!strcmp(op->forth_word, forth_word)) {
+            def->op = op;
+            break;
+        }
+    }
 }
 
+// The user word whose function or variable is c_name. A variable's getter
+// comes before its setter.
+static struct definition *symbol_definition(const char *c_name)
+{
+    struct definition *def;
+    size_t i;
+
+    for (i = 0; i < definitions->len; i++) {
+        def = vec_get(definitions, i);
+        if ((def->tag == DEF_USER)
+            && (!strcmp(def->c_func_name, c_name)
+                || (def->c_var_name && !strcmp(def->c_var_name, c_name)))) {
+            return def;
+        }
+    }
+    return 0;
+}
+
+// One line in the -m map for a symbol that is written out: the symbol, the
+// Forth word, and where the word is defined. The symbol is named after
+// c_name, the function or variable of the word.
+static void record_symbol(const char *symbol, const char *c_name)
+{
+    struct definition *def;
+    struct token *tok;
+    char where[64];
+
+    if (!symbol_map || !(def = symbol_definition(c_name))) {
+        return;
+    }
+    tok = vec_get(tokens, def->name_token);
+    snprintf(where, sizeof(where), ":%zu:%zu\n", tok->line, tok->column);
+    vec_puts(symbol_map, symbol);
+    vec_putc(symbol_map, '\t');
+    vec_puts(symbol_map, def->forth_word);
+    vec_putc(symbol_map, '\t');
+    vec_puts(symbol_map, source_name);
+    vec_puts(symbol_map, where);
+}
+
+// Called right after reading the name.
 static struct definition *define_user(const char *forth_word)
 {
     struct definition *def = allocate_definition(forth_word);
     def->tag = DEF_USER;
     def->c_func_name = mangle("word_", forth_word);
+    def->name_token = tokens_pos - 1;
     return def;
 }
 
-static struct local *lookup_local(const char *forth_word, int *out_is_setter)
+static struct local *lookup_local_span(
+    const char *forth_word, size_t len, int *out_is_setter)
 {
+    size_t binding = table_get_span(local_table, forth_word, len);
+    size_t i;
+
     *out_is_setter = 0;
-    size_t i = locals->len;
-    while (i) {
-        struct local *local = vec_get(locals, --i);
-        if (!strcmp(forth_word, local->forth_word)) {
-            return local;
-        }
-        if (!strcmp(forth_word, local->forth_word_setter)) {
-            *out_is_setter = 1;
-            return local;
-        }
+    if (!binding) {
+        return 0;
     }
-    return 0;
+    if ((i = binding / 2 - 1) < locals_base) {
+        return 0;
+    }
+    *out_is_setter = (int)(binding % 2);
+    return vec_get(locals, i);
+}
+
+static struct local *lookup_local(const char *forth_word, int *out_is_setter)
+{
+    return lookup_local_span(forth_word, strlen(forth_word), out_is_setter);
+}
+
+static struct local *lookup_local_token(
+    struct token *tok, int *out_is_setter)
+{
+    return lookup_local_span(tok->string, tok->length, out_is_setter);
 }
 
 static void add_local(const char *forth_word)
@@ -548,233 +1745,4048 @@ static void add_local(const char *forth_word)
     local = vec_reserve(locals, 1);
     local->forth_word = copy_string(forth_word);
     local->forth_word_setter = copy_two_strings(forth_word, "!");
-    local->c_var_name = mangle("local_", forth_word);
+    local->c_var_name
+        = mangle_in(local_pool, local_suffixes, "local_", forth_word);
+    local->shadowed = table_get(local_table, local->forth_word);
+    local->shadowed_setter = table_get(local_table, local->forth_word_setter);
+    table_put(local_table, local->forth_word, 2 * locals->len);
+    table_put(local_table, local->forth_word_setter, 2 * locals->len + 1);
 }
 
-static void compile_locals(void)
+static char *new_temp(void)
 {
-    size_t i = locals->len;
-    while (i > locals->mark) {
-        if (i < locals->len)
-            display(indent);
-        struct local *local = vec_get(locals, --i);
-        display("uintptr_t ");
-        display(local->c_var_name);
-        displayln(" = pop();");
-    }
+    char name[32];
+
+    snprintf(name, sizeof(name), "t%zu", ++ntemp);
+    return copy_string(name);
 }
 
-static void rollback_locals(void)
+static void vstack_push(char *expr, int is_temp)
 {
-    size_t i = locals->len;
-    while (i) {
-        struct local *local = vec_get(locals, --i);
-        free(local->forth_word_setter);
-        // free(local->c_var_name); //! TODO: use-after-free
-    }
-    locals->mark = 0;
-    vec_clear_to_mark(locals);
+    struct entry *e = vec_reserve(vstack, 1);
+    memset(e, 0, sizeof(*e));
+    e->expr = expr;
+    e->is_temp = is_temp;
+    e->range = full_range;
 }
 
-static void compile_top_level_variable(void)
+static void vstack_push_uintptr(uintptr_t u, int is_negative)
 {
-    struct definition *def;
-    struct token *tok;
-    char *forth_word;
-    char *forth_word_setter;
-    char *c_var_name;
+    struct entry *e;
+    char expr[64];
 
-    if (!(tok = read_token(TOK_WORD))) {
-        panic("variable name expected");
-    }
-    forth_word = tok->string;
-    forth_word_setter = copy_two_strings(forth_word, "!");
-    c_var_name = mangle("var_", forth_word);
+    snprintf(expr, sizeof(expr), "%s%" PRIuPTR,
+        is_negative ? "(uintptr_t)-(intptr_t)" : "", u);
+    vstack_push(copy_string(expr), 0);
+    e = vec_get(vstack, vstack->len - 1);
+    e->range.lo = e->range.hi = is_negative ? -u : u;
+}
 
-    display("static uintptr_t ");
-    display(c_var_name);
-    displayln(";");
-    newline();
+// Values that do not fit in intptr_t are written in hex, which C gives an
+// unsigned type.
+static void vstack_push_const(uintptr_t value)
+{
+    char expr[64];
+    struct entry *e;
 
-    def = define_user(forth_word);
-    display("static void ");
+    if (value <= INTPTR_MAX) {
+        vstack_push_uintptr(value, 0);
+        return;
+    }
+    snprintf(expr, sizeof(expr), "0x%" PRIxPTR, value);
+    vstack_push(copy_string(expr), 0);
+    e = vec_get(vstack, vstack->len - 1);
+    e->range.lo = e->range.hi = value;
+}
+
+// Make sure the top n values are tracked by the compiler, popping the
+// missing ones from the real stack into temporaries.
+static void vstack_need(size_t n)
+{
+    struct entry *e;
+    char *temp;
+
+    while (vstack->len < n) {
+        temp = new_temp();
+        display_indent();
+        display("uintptr_t ");
+        display(temp);
+        if (option_registers) {
+            displayln(" = tos;");
+            display_indent();
+            displayln("FORTH_DROP();");
+        } else {
+            displayln(" = pop();");
+        }
+        record_stack_event(STACK_ADJUST, -1);
+        vec_reserve(vstack, 1);
+        memmove(vec_get(vstack, 1), vec_get(vstack, 0),
+            vstack->itemsize * (vstack->len - 1));
+        e = vec_get(vstack, 0);
+        memset(e, 0, sizeof(*e));
+        e->expr = temp;
+        e->is_temp = 1;
+        e->range = full_range;
+    }
+}
+
+static struct entry vstack_pop(void)
+{
+    vstack_need(1);
+    return *(struct entry *)vec_get(vstack, --vstack->len);
+}
+
+static void display_pushes(void)
+{
+    size_t i;
+
+    for (i = 0; i < vstack->len; i++) {
+        struct entry *e = vec_get(vstack, i);
+        display_indent();
+        display(option_registers ? "FORTH_PUSH(" : "push(");
+        display(e->expr);
+        displayln(");");
+    }
+}
+
+// Move every value tracked by the compiler to the real stack.
+static void flush(void)
+{
+    display_pushes();
+    record_stack_event(STACK_ADJUST, (long)vstack->len);
+    vstack->len = 0;
+}
+
+// Within a function, flag is kept in the local lflag so that the C
+// compiler can keep it in a register. The global is only brought up to
+// date for calls that can look at it and for returns, and lflag is only
+// reloaded after calls that can change it. With -r, lflag goes along with
+// calls and returns, and FORTH_PRIM updates the global around primitives.
+static const char *flag_name(void)
+{
+    if (option_global_flag) {
+        return "flag";
+    }
+    flag_used = 1;
+    return "lflag";
+}
+
+static void load_flag(void)
+{
+    if (!flag_in_local) {
+        display_indent();
+        displayln("lflag = flag;");
+        flag_in_local = flag_used = 1;
+    }
+}
+
+static void store_flag(void)
+{
+    if (!flag_in_global) {
+        display_indent();
+        displayln("flag = lflag;");
+        flag_in_global = flag_used = flag_read = 1;
+    }
+}
+
+static const char *read_flag(void)
+{
+    load_flag();
+    flag_read = 1;
+    return flag_name();
+}
+
+static const char *write_flag(void)
+{
+    if (!option_global_flag && !option_registers) {
+        flag_in_local = 1;
+        flag_in_global = 0;
+    }
+    return flag_name();
+}
+
+static void clobber_flag(void)
+{
+    if (!option_global_flag && !option_registers) {
+        flag_in_local = 0;
+        flag_in_global = 1;
+    }
+}
+
+static struct fact *find_fact(const char *name)
+{
+    struct fact *fact;
+    size_t i;
+
+    for (i = 0; i < facts->len; i++) {
+        fact = vec_get(facts, i);
+        if (!strcmp(fact->name, name)) {
+            return fact;
+        }
+    }
+    return 0;
+}
+
+static struct range known_range(const char *name)
+{
+    struct fact *fact = find_fact(name);
+
+    return fact ? fact->range : full_range;
+}
+
+static void set_fact(const char *name, int is_variable, struct range range)
+{
+    struct fact *fact = find_fact(name);
+
+    if (!fact) {
+        fact = vec_reserve(facts, 1);
+        fact->name = name;
+        fact->is_variable = is_variable;
+    }
+    fact->range = range;
+}
+
+// Values that were copied from a local or variable are no longer its
+// value once it is stored to.
+static void forget_origin(const char *name)
+{
+    struct entry *e;
+    size_t i;
+
+    for (i = 0; i < vstack->len; i++) {
+        e = vec_get(vstack, i);
+        if (e->origin && !strcmp(e->origin, name)) {
+            e->origin = 0;
+        }
+    }
+}
+
+static int unit_writes(struct unit *unit, const char *name)
+{
+    size_t i;
+
+    if (unit->writes_all) {
+        return 1;
+    }
+    for (i = 0; i < unit->writes->len; i++) {
+        if (!strcmp(*(char **)vec_get(unit->writes, i), name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void add_write(const char *name)
+{
+    struct unit *unit = vec_get(units, current_unit);
+
+    if (!unit_writes(unit, name)) {
+        *(const char **)vec_reserve(unit->writes, 1) = name;
+    }
+}
+
+// Forget what is known about the variables that a callee may store to. A
+// null callee could store to any of them.
+static void forget_variables(struct unit *callee)
+{
+    struct fact *fact;
+    size_t i, j;
+
+    for (i = j = 0; i < facts->len; i++) {
+        fact = vec_get(facts, i);
+        if (fact->is_variable
+            && (!callee || unit_writes(callee, fact->name))) {
+            continue;
+        }
+        *(struct fact *)vec_get(facts, j++) = *fact;
+    }
+    facts->len = j;
+}
+
+// The caller may store to whatever the callee stores to. Calling a quoted
+// word, or waiting for another thread, could store to anything.
+static void forget_call_writes(struct definition *def)
+{
+    struct unit *unit = vec_get(units, current_unit);
+    struct unit *callee;
+    size_t i;
+
+    if (def->tag != DEF_USER) {
+        if (def->calls_quoted || def->syncs) {
+            unit->writes_all = 1;
+            forget_variables(0);
+        }
+        return;
+    }
+    callee = vec_get(units, def->unit - 1);
+    unit->writes_all |= callee->writes_all;
+    for (i = 0; i < callee->writes->len; i++) {
+        add_write(*(char **)vec_get(callee->writes, i));
+    }
+    forget_variables(callee);
+}
+
+static struct vec *copy_facts(void)
+{
+    struct vec *copy = vec_new(sizeof(struct fact));
+
+    memcpy(vec_reserve(copy, facts->len), facts->bytes,
+        facts->len * facts->itemsize);
+    return copy;
+}
+
+// Keep only the facts that also hold in other, widened to cover both.
+static void join_facts(struct vec *into, struct vec *other)
+{
+    struct fact *fact, *o;
+    size_t i, j, k;
+
+    for (i = j = 0; i < into->len; i++) {
+        fact = vec_get(into, i);
+        for (k = 0; k < other->len; k++) {
+            o = vec_get(other, k);
+            if (!strcmp(o->name, fact->name)) {
+                break;
+            }
+        }
+        if (k == other->len) {
+            continue;
+        }
+        fact->range.lo = min_uintptr(fact->range.lo, o->range.lo);
+        fact->range.hi = max_uintptr(fact->range.hi, o->range.hi);
+        *(struct fact *)vec_get(into, j++) = *fact;
+    }
+    into->len = j;
+}
+
+// What is known at a break out of a block is joined with what is known at
+// the other breaks, and at its end.
+static void record_break(void)
+{
+    struct block *block = vec_get(open_blocks, open_blocks->len - 1);
+
+    if (!block->facts) {
+        block->facts = copy_facts();
+    } else {
+        join_facts(block->facts, facts);
+    }
+    block->flag_in_global &= flag_in_global;
+}
+
+// Once a guard has passed, the values it compared are known to be in
+// narrower ranges, and so are the locals and variables they came from.
+static void refine_entry(const struct entry *arg, struct range range)
+{
+    struct fact *fact;
+    struct entry *e;
+    size_t i;
+
+    if ((arg->range.lo == arg->range.hi) || (range.lo > range.hi)) {
+        return;
+    }
+    for (i = 0; i < vstack->len; i++) {
+        e = vec_get(vstack, i);
+        if (!strcmp(e->expr, arg->expr)) {
+            e->range = range;
+        }
+    }
+    if (!arg->origin) {
+        return;
+    }
+    // Locals get a fact when they are bound, so a new one is a variable.
+    if ((fact = find_fact(arg->origin))) {
+        fact->range = range;
+    } else {
+        set_fact(arg->origin, 1, range);
+    }
+}
+
+static void refine_guard(const struct op *op, struct entry *args)
+{
+    const struct guard *guard;
+    struct range a = args[0].range;
+    struct range b = args[1].range;
+    int is_true = (op->branch == '&');
+
+    for (guard = guards; guard->flag; guard++) {
+        if (!strcmp(guard->flag, op->flag)) {
+            break;
+        }
+    }
+    if (!guard->flag || !(is_true ? guard->if_true : guard->if_false)) {
+        return;
+    }
+    (is_true ? guard->if_true : guard->if_false)(&a, &b);
+    refine_entry(&args[0], a);
+    refine_entry(&args[1], b);
+}
+
+static char *expand_template(const char *template, struct entry *args)
+{
+    struct vec *expanded;
+
+    expanded = vec_new(sizeof(char));
+    for (; *template; template++) {
+        if ((template[0] == '$') && isdigit(template[1])) {
+            template++;
+            vec_puts(expanded, args[template[0] - '1'].expr);
+        } else if ((template[0] == '$') && (template[1] == 'f')) {
+            template++;
+            vec_puts(expanded, flag_name());
+        } else {
+            vec_putc(expanded, template[0]);
+        }
+    }
+    vec_putc(expanded, 0);
+    return (char *)expanded->bytes;
+}
+
+static void display_template(const char *template, struct entry *args)
+{
+    display(expand_template(template, args));
+}
+
+static int template_uses(const char *template, char argchar)
+{
+    for (; template && *template; template++) {
+        if ((template[0] == '$') && (template[1] == argchar)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// With a profile, a word is hot if it takes a good share of the calls or
+// of the time, and cold if the profile never saw it called.
+static int word_heat(struct definition *def)
+{
+    struct word_profile *count;
+    size_t i;
+
+    if (!word_profiles) {
+        return 0;
+    }
+    if (!(i = table_get(word_profiles, def->forth_word))) {
+        return -1;
+    }
+    count = vec_get(word_profile_counts, i - 1);
+    return ((count->calls * 100 >= profile_all_calls * HOT_PERCENT)
+               || (count->self * 100 >= profile_all_self * HOT_PERCENT))
+        ? 1
+        : 0;
+}
+
+static void display_heat_attribute(struct definition *def)
+{
+    switch (word_heat(def)) {
+    case 1:
+        display("__attribute__((__hot__)) ");
+        break;
+    case -1:
+        display("__attribute__((__cold__, __noinline__)) ");
+        break;
+    }
+}
+
+// The percentage of runs in which the exit at the & or | token was taken,
+// or -1 if the profile does not say.
+static int exit_bias(struct token *site)
+{
+    struct exit_profile *count;
+    char key[48];
+    size_t i;
+
+    if (!exit_profiles) {
+        return -1;
+    }
+    snprintf(key, sizeof(key), "%zu:%zu", site->line, site->column);
+    if (!(i = table_get(exit_profiles, key))) {
+        return -1;
+    }
+    count = vec_get(exit_profile_counts, i - 1);
+    if (count->taken + count->not_taken < MIN_BIASED_EXITS) {
+        return -1;
+    }
+    return (int)(count->taken * 100 / (count->taken + count->not_taken));
+}
+
+// With -p, each exit counts which way it goes in a counter declared before
+// the function. With -u, it tells the C compiler which way it usually goes.
+static void display_exit_condition(const char *condition, struct token *site)
+{
+    struct definition *def = vec_get(definitions, current_definition);
+    int bias = exit_bias(site);
+    char s[128];
+
+    if (option_profile) {
+        snprintf(s, sizeof(s), "branch_%s_%zu", def->c_func_name, ++nexit);
+        vec_puts(exit_counters, "static struct profile_branch ");
+        vec_puts(exit_counters, s);
+        display("profile_count_branch(&");
+        display(s);
+        display(", ");
+        snprintf(s, sizeof(s), " = {.line = %zu, .column = %zu};\n",
+            site->line, site->column);
+        vec_puts(exit_counters, s);
+    }
+    if (bias >= 0) {
+        display("__builtin_expect_with_probability(");
+    }
+    display(condition);
+    if (bias >= 0) {
+        snprintf(s, sizeof(s), ", 1, %d.%02d)", bias / 100, bias % 100);
+        display(s);
+    }
+    if (option_profile) {
+        display(")");
+    }
+}
+
+// Return early when the condition holds, first moving the values the
+// compiler is tracking to the real stack.
+static void compile_exit(const char *condition, int exit_flag)
+{
+    struct token *site = vec_get(tokens, tokens_pos - 1);
+    int is_return = 1;
+
+    if (strcmp(exit_statement, return_statement)) {
+        is_return = 0;
+    }
+    record_stack_event(is_return ? STACK_EXIT_IF : STACK_BREAK_IF,
+        (long)vstack->len)
+        ->flag
+        = exit_flag;
+    if (!is_return) {
+        record_break();
+    }
+    display_indent();
+    display("if (");
+    display_exit_condition(condition, site);
+    if (!vstack->len && (!is_return || flag_in_global)) {
+        display(") ");
+        displayln(exit_statement);
+        return;
+    }
+    displayln(") {");
+    depth++;
+    display_pushes();
+    if (is_return && !flag_in_global) {
+        display_indent();
+        displayln("flag = lflag;");
+        flag_read = 1;
+    }
+    display_indent();
+    displayln(exit_statement);
+    depth--;
+    display_indent();
+    displayln("}");
+}
+
+static int fold_op(const struct op *op, struct entry *args, struct range *out)
+{
+    struct range in[9];
+    size_t i;
+
+    if (!op->fold) {
+        return 0;
+    }
+    for (i = 0; i < op->nin; i++) {
+        in[i] = args[i].range;
+    }
+    return op->fold(in, out);
+}
+
+// Temporaries that the templates do not use are still used in the
+// generated C so that it compiles without warnings.
+static void discard_unused_temps(
+    const char *templates[4], size_t nin, struct entry *args)
+{
+    size_t i, j;
+    char argchar;
+
+    for (i = 0; i < nin; i++) {
+        argchar = (char)('1' + i);
+        if (!args[i].is_temp) {
+            continue;
+        }
+        for (j = 0; j < 4; j++) {
+            if (template_uses(templates[j], argchar)) {
+                break;
+            }
+        }
+        if (j == 4) {
+            display_indent();
+            display("(void)");
+            display(args[i].expr);
+            displayln(";");
+        }
+    }
+}
+
+static void compile_op(const struct op *op)
+{
+    struct entry args[9];
+    struct range range;
+    const char *templates[4];
+    char *condition;
+    const char *out;
+    char *temp;
+    size_t i;
+    int is_safe;
+
+    vstack_need(op->nin);
+    vstack->len -= op->nin;
+    memcpy(args, vec_get(vstack, vstack->len), op->nin * sizeof(*args));
+    is_safe = fold_op(op, args, &range);
+    memset(templates, 0, sizeof(templates));
+    if (is_safe && (range.lo == range.hi)) {
+        discard_unused_temps(templates, op->nin, args);
+        vstack_push_const(range.lo);
+        return;
+    }
+    templates[0] = op->stmt;
+    templates[1] = op->flag;
+    templates[2] = op->outs[0];
+    templates[3] = op->outs[1];
+    if (is_safe && op->unchecked) {
+        templates[2] = op->unchecked;
+        ((struct unit *)vec_get(units, current_unit))->unchecked++;
+    }
+    discard_unused_temps(templates, op->nin, args);
+    if (op->stmt) {
+        display_indent();
+        display_template(op->stmt, args);
+        newline();
+    }
+    if (op->flag) {
+        record_stack_event(STACK_SET_FLAG, 0);
+    }
+    if (template_uses(templates[2], 'f')
+        || template_uses(templates[3], 'f')) {
+        read_flag();
+    }
+    if (op->flag && !op->branch) {
+        display_indent();
+        display(write_flag());
+        display(" = ");
+        display_template(op->flag, args);
+        displayln(";");
+    }
+    for (i = 0; (i < 2) && (out = templates[2 + i]); i++) {
+        if ((out[0] == '$') && isdigit(out[1]) && !out[2]) {
+            *(struct entry *)vec_reserve(vstack, 1) = args[out[1] - '1'];
+            continue;
+        }
+        temp = new_temp();
+        display_indent();
+        display("uintptr_t ");
+        display(temp);
+        display(" = ");
+        display_template(out, args);
+        displayln(";");
+        vstack_push(temp, 1);
+        if (!i && is_safe) {
+            ((struct entry *)vec_get(vstack, vstack->len - 1))->range
+                = range;
+        }
+    }
+    if (op->branch) {
+        condition = copy_two_strings(
+            copy_two_strings((op->branch == '&') ? "!(" : "(", write_flag()),
+            copy_two_strings(" = ",
+                copy_two_strings(expand_template(op->flag, args), ")")));
+        compile_exit(condition, op->branch == '|');
+        refine_guard(op, args);
+    }
+}
+
+static void compile_call(struct definition *def)
+{
+    flush();
+    if (!option_registers) {
+        display_indent();
+        display(def->c_func_name);
+        displayln("();");
+        return;
+    }
+    flush_line_directive();
+    tail_call_start = output->len;
+    display_indent();
+    display((def->tag == DEF_PRIMITIVE) ? "FORTH_PRIM(" : "FORTH_CALL(");
     display(def->c_func_name);
-    displayln("(void) {");
-    display(indent);
-    display("push(");
-    display(c_var_name);
     displayln(");");
-    displayln("}");
-    newline();
+    if (def->tag != DEF_PRIMITIVE) {
+        tail_call_end = output->len;
+        tail_call_name = def->c_func_name;
+    }
+}
+
+// With -r, a call to a word that is the last thing a function does becomes
+// a tail call, so that the callee returns straight to the caller's caller.
+static void display_return(void)
+{
+    if (output->len == tail_call_end) {
+        output->len = tail_call_start;
+        display(indent);
+        display("FORTH_TAIL_CALL(");
+        display(tail_call_name);
+        displayln(");");
+    } else {
+        display(indent);
+        displayln("FORTH_RETURN;");
+    }
+}
+
+static void compile_local_fetch(struct local *local)
+{
+    struct entry *e;
+
+    vstack_push(local->c_var_name, 0);
+    e = vec_get(vstack, vstack->len - 1);
+    e->range = known_range(local->c_var_name);
+    e->origin = local->c_var_name;
+}
+
+static void compile_local_store(struct local *local)
+{
+    struct entry value;
+    struct entry *e;
+    char *temp;
+    size_t i;
+
+    value = vstack_pop();
+    for (i = 0; i < vstack->len; i++) {
+        e = vec_get(vstack, i);
+        if (e->expr != local->c_var_name) {
+            continue;
+        }
+        temp = new_temp();
+        display_indent();
+        display("uintptr_t ");
+        display(temp);
+        display(" = ");
+        display(local->c_var_name);
+        displayln(";");
+        e->expr = temp;
+        e->is_temp = 1;
+    }
+    forget_origin(local->c_var_name);
+    set_fact(local->c_var_name, 0, value.range);
+    display_indent();
+    display(local->c_var_name);
+    display(" = ");
+    display(value.expr);
+    displayln(";");
+}
+
+static void compile_locals(void)
+{
+    struct entry value;
+    size_t i = locals->len;
+    while (i > locals->mark) {
+        struct local *local = vec_get(locals, --i);
+        value = vstack_pop();
+        set_fact(local->c_var_name, 0, value.range);
+        display_indent();
+        display("uintptr_t ");
+        display(local->c_var_name);
+        display(" = ");
+        display(value.expr);
+        displayln(";");
+        // Uses of a local with a known value can all be folded away.
+        if (value.range.lo == value.range.hi) {
+            display_indent();
+            display("(void)");
+            display(local->c_var_name);
+            displayln(";");
+        }
+    }
+}
+
+static void truncate_locals(size_t len)
+{
+    size_t i = locals->len;
+    while (i > len) {
+        struct local *local = vec_get(locals, --i);
+        table_put(local_table, local->forth_word_setter,
+            local->shadowed_setter);
+        table_put(local_table, local->forth_word, local->shadowed);
+        free(local->forth_word_setter);
+        // free(local->c_var_name); //! TODO: use-after-free
+    }
+    locals->mark = len;
+    vec_clear_to_mark(locals);
+}
+
+static void rollback_locals(void) { truncate_locals(0); }
+
+static struct op *variable_op(size_t nin, char *stmt, char *out)
+{
+    struct op *op = zeroalloc(sizeof(*op));
+    op->nin = nin;
+    op->stmt = stmt;
+    op->outs[0] = out;
+    return op;
+}
+
+static void compile_variable(int is_thread_local)
+{
+    struct definition *def;
+    struct token *tok;
+    struct unit *unit;
+    char *forth_word;
+    char *forth_word_setter;
+    char *c_var_name;
+    size_t data_unit;
+
+    if (!(tok = read_token(TOK_WORD))) {
+        panic("variable name expected");
+    }
+    forth_word = token_string(tok);
+    forth_word_setter = copy_two_strings(forth_word, "!");
+    c_var_name = mangle("var_", forth_word);
+
+    data_unit = begin_unit(forth_word, c_var_name);
+    unit = vec_get(units, data_unit - 1);
+    unit->is_variable = 1;
+    unit->is_thread_local = is_thread_local;
+    display_line_directive(tok);
+    display(linkage);
+    display(is_thread_local ? "__thread uintptr_t " : "uintptr_t ");
+    display(c_var_name);
+    displayln(";");
+
+    def = define_user(forth_word);
+    def->op = variable_op(0, 0, c_var_name);
+    def->data_unit = data_unit;
+    def->c_var_name = c_var_name;
+    def->unit = begin_unit(0, def->c_func_name);
+    use_unit(data_unit);
+    display_line_directive(tok);
+    display_function_start(def->c_func_name);
+    display(indent);
+    display(option_registers ? "FORTH_PUSH(" : "push(");
+    display(c_var_name);
+    displayln(");");
+    if (option_registers) {
+        display_return();
+    }
+    displayln("}");
+    record_stack_event(STACK_ADJUST, 1);
+    record_stack_event(STACK_RETURN, 0);
+
+    def = define_user(forth_word_setter);
+    def->op = variable_op(1, copy_two_strings(c_var_name, " = $1;"), 0);
+    def->data_unit = data_unit;
+    def->c_var_name = c_var_name;
+    def->unit = begin_unit(0, def->c_func_name);
+    use_unit(data_unit);
+    display_line_directive(tok);
+    display_function_start(def->c_func_name);
+    display(indent);
+    display(c_var_name);
+    if (option_registers) {
+        displayln(" = tos;");
+        display(indent);
+        displayln("FORTH_DROP();");
+        display_return();
+    } else {
+        displayln(" = pop();");
+    }
+    displayln("}");
+    record_stack_event(STACK_ADJUST, -1);
+    record_stack_event(STACK_RETURN, 0);
+}
+
+static void compile_top_level_variable(void) { compile_variable(0); }
+
+static void compile_top_level_thread_variable(void) { compile_variable(1); }
+
+static int token_is_builtin(size_t pos, const char *word)
+{
+    struct token *tok;
+    struct definition *def;
+    int is_setter;
+
+    if (pos >= tokens->len) {
+        return 0;
+    }
+    tok = vec_get(tokens, pos);
+    if (tok->tag == TOK_UINT) {
+        return span_equals(tok->string, tok->length, word);
+    }
+    if (!token_is_word(tok, word) || lookup_local(word, &is_setter)) {
+        return 0;
+    }
+    def = lookup(word, 0);
+    return def && (def->tag & (DEF_COMPILE | DEF_PRIMITIVE));
+}
+
+static struct fusion *read_fusion(void)
+{
+    struct fusion *fusion;
+    size_t i;
+
+    for (fusion = fusions; fusion->words[0]; fusion++) {
+        for (i = 0; fusion->words[i]; i++) {
+            if (!token_is_builtin(tokens_pos + i, fusion->words[i])) {
+                break;
+            }
+        }
+        if (!fusion->words[i]) {
+            tokens_pos += i;
+            fusion->fired++;
+            return fusion;
+        }
+    }
+    return 0;
+}
+
+static void compile_body_item(void);
+static void compile_and(void);
+static void compile_or(void);
+static void compile_recurse(void);
+
+// Small words are compiled into their callers unless they are recursive
+// or use a word that has been redefined since. Words that inline words that
+// inline words are only inlined so deep, so that a chain of small words is
+// not expanded into every word after it.
+static int can_inline(struct definition *def, int *out_has_exit)
+{
+    struct token *tok;
+    struct definition *inner_def;
+    size_t i;
+
+    *out_has_exit = 0;
+    if (!def->body_end || def->noinline) {
+        return 0;
+    }
+    if ((def->inline_depth > MAX_INLINE_DEPTH)
+        || (def->body_end - def->body_start > inline_threshold
+                * ((word_heat(def) > 0) ? HOT_INLINE_FACTOR : 1))) {
+        return 0;
+    }
+    for (i = def->body_start; i < def->body_end; i++) {
+        tok = vec_get(tokens, i);
+        if (tok->tag != TOK_WORD) {
+            continue;
+        }
+        if (!(inner_def = lookup_token(tok, 0))) {
+            continue;
+        }
+        if (inner_def->generation >= def->generation) {
+            return 0;
+        }
+        if (inner_def->compile == compile_recurse) {
+            return 0;
+        }
+        if ((inner_def->compile == compile_and)
+            || (inner_def->compile == compile_or)) {
+            *out_has_exit = 1;
+        }
+    }
+    return 1;
+}
+
+// Called once the body has been compiled or replayed from the cache.
+static void end_body(struct definition *def, size_t end)
+{
+    struct definition *inner_def;
+    struct token *tok;
+    int has_exit;
+    size_t i;
+
+    def->body_end = end;
+    def->inline_depth = 1;
+    for (i = def->body_start; i < end; i++) {
+        tok = vec_get(tokens, i);
+        inner_def = (tok->tag == TOK_WORD) ? lookup_token(tok, 0) : 0;
+        if (inner_def && (inner_def->tag == DEF_USER)
+            && !inner_def->c_var_name && !inner_def->constants
+            && can_inline(inner_def, &has_exit)
+            && (inner_def->inline_depth >= def->inline_depth)) {
+            def->inline_depth = inner_def->inline_depth + 1;
+        }
+    }
+}
+
+// Inlined bodies that return early are wrapped in a block that they can
+// break out of.
+static void compile_inline(struct definition *def, int has_exit)
+{
+    const char *saved_exit_statement = exit_statement;
+    size_t saved_locals_base = locals_base;
+    size_t saved_locals_len = locals->len;
+    size_t saved_tokens_pos = tokens_pos;
+    struct block *block;
+
+    if (has_exit) {
+        block = vec_reserve(open_blocks, 1);
+        block->facts = 0;
+        block->flag_in_global = 1;
+        record_stack_event(STACK_BLOCK, 0);
+        display_indent();
+        displayln("do {");
+        depth++;
+        exit_statement = "break;";
+    }
+    locals_base = locals->len;
+    tokens_pos = def->body_start;
+    while (tokens_pos < def->body_end) {
+        compile_body_item();
+    }
+    tokens_pos = saved_tokens_pos;
+    truncate_locals(saved_locals_len);
+    locals_base = saved_locals_base;
+    if (has_exit) {
+        flush();
+        block = vec_get(open_blocks, --open_blocks->len);
+        if (block->facts) {
+            join_facts(facts, block->facts);
+            load_flag();
+            flag_in_global &= block->flag_in_global;
+        }
+        record_stack_event(STACK_END_BLOCK, 0);
+        depth--;
+        display_indent();
+        displayln("} while (0);");
+        exit_statement = saved_exit_statement;
+    }
+}
+
+static void record_call(struct definition *def)
+{
+    if (def->tag == DEF_USER) {
+        record_stack_event(STACK_CALL, (long)def->unit - 1);
+        return;
+    }
+    record_stack_event(STACK_ADJUST, -(long)def->nin);
+    if (def->noreturn) {
+        record_stack_event(STACK_HALT, 0);
+        return;
+    }
+    if (def->calls_quoted) {
+        record_stack_event(STACK_CALL_QUOTED, 0);
+    }
+    record_stack_event(STACK_ADJUST, (long)def->nout);
+    if (def->sets_flag) {
+        record_stack_event(STACK_SET_FLAG, 0);
+    }
+}
+
+// The values of variables are tracked like those of locals, as long as
+// nothing else can store to them.
+static void compile_variable_op(struct definition *def)
+{
+    struct range range;
+    struct entry *e;
+
+    if (!def->op->nin) {
+        compile_op(def->op);
+        e = vec_get(vstack, vstack->len - 1);
+        e->range = known_range(def->c_var_name);
+        e->origin = def->c_var_name;
+        return;
+    }
+    vstack_need(1);
+    range = ((struct entry *)vec_get(vstack, vstack->len - 1))->range;
+    compile_op(def->op);
+    forget_origin(def->c_var_name);
+    set_fact(def->c_var_name, 1, range);
+    add_write(def->c_var_name);
+}
+
+static void compile_constants(struct vec *constants)
+{
+    size_t i;
+
+    for (i = 0; i < constants->len; i++) {
+        vstack_push_const(*(uintptr_t *)vec_get(constants, i));
+    }
+}
+
+static void compile_word(struct definition *def)
+{
+    int has_exit;
+
+    if (def->c_var_name) {
+        use_unit(def->data_unit);
+        compile_variable_op(def);
+    } else if (def->op) {
+        compile_op(def->op);
+    } else if (def->constants && !def->noinline) {
+        compile_constants(def->constants);
+    } else if (can_inline(def, &has_exit)) {
+        compile_inline(def, has_exit);
+    } else {
+        use_unit(def->unit);
+        if ((def->tag == DEF_USER) || def->calls_quoted || def->reads_flag) {
+            store_flag();
+        }
+        compile_call(def);
+        record_call(def);
+        forget_call_writes(def);
+        if ((def->tag == DEF_USER) || def->calls_quoted || def->sets_flag) {
+            clobber_flag();
+        }
+    }
+}
+
+// The tag checked by an arm of a dispatch like "d-bignum | d-string | ...",
+// whose body starts with "<constant> = &". Called with any other tag, an
+// arm only clears flag.
+static int arm_tag(size_t pos, uintptr_t *out_tag)
+{
+    struct definition *def;
+    struct definition *constant;
+    struct token *tok;
+    int is_setter;
+
+    if (pos >= tokens->len) {
+        return 0;
+    }
+    tok = vec_get(tokens, pos);
+    if ((tok->tag != TOK_WORD) || lookup_local_token(tok, &is_setter)
+        || !(def = lookup_token(tok, 0)) || (def->tag != DEF_USER)
+        || !def->body_end || (def->body_end - def->body_start < 3)
+        || !token_is_builtin(def->body_start + 1, "=")
+        || !token_is_builtin(def->body_start + 2, "&")) {
+        return 0;
+    }
+    tok = vec_get(tokens, def->body_start);
+    if (tok->tag & (TOK_CHAR | TOK_UINT)) {
+        *out_tag = tok->number;
+        return 1;
+    }
+    if (tok->tag == TOK_NEGINT) {
+        *out_tag = -tok->number;
+        return 1;
+    }
+    if ((tok->tag != TOK_WORD) || !(constant = lookup_token(tok, 0))
+        || (constant->generation > def->generation) || !constant->constants
+        || (constant->constants->len != 1)) {
+        return 0;
+    }
+    *out_tag = *(uintptr_t *)vec_get(constant->constants, 0);
+    return 1;
+}
+
+static void display_label(size_t label)
+{
+    char s[32];
+
+    snprintf(s, sizeof(s), "arm_%zu", label);
+    display(s);
+}
+
+// Returns whether an earlier arm checks for the same tag as arm i.
+static int is_shadowed_arm(struct vec *tags, size_t i)
+{
+    size_t j;
+
+    for (j = 0; j < i; j++) {
+        if (*(uintptr_t *)vec_get(tags, j)
+            == *(uintptr_t *)vec_get(tags, i)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A chain of arms separated by | is compiled as it is written, but a
+// switch on the tag first jumps to the arm that will match, or to the last
+// one if none will. The arms it skips would only have cleared flag.
+static int compile_switch(void)
+{
+    struct vec *tags = vec_new(sizeof(uintptr_t));
+    uintptr_t tag;
+    char *expr;
+    char value[32];
+    size_t first_label = nlabel + 1;
+    size_t pos, i;
+
+    for (pos = tokens_pos; arm_tag(pos, &tag); pos += 2) {
+        *(uintptr_t *)vec_reserve(tags, 1) = tag;
+        if (!token_is_builtin(pos + 1, "|")) {
+            break;
+        }
+    }
+    if (tags->len < MIN_SWITCH_ARMS) {
+        return 0;
+    }
+    vstack_need(1);
+    expr = ((struct entry *)vec_get(vstack, vstack->len - 1))->expr;
+    flush();
+    load_flag();
+    store_flag();
+    display_indent();
+    display("switch (");
+    display(expr);
+    displayln(") {");
+    for (i = 0; i < tags->len; i++) {
+        if (is_shadowed_arm(tags, i)) {
+            continue;
+        }
+        tag = *(uintptr_t *)vec_get(tags, i);
+        snprintf(value, sizeof(value),
+            (tag > INTPTR_MAX) ? "0x%" PRIxPTR : "%" PRIuPTR, tag);
+        display_indent();
+        display("case ");
+        display(value);
+        display(": goto ");
+        display_label(first_label + i);
+        displayln(";");
+    }
+    display_indent();
+    display("default: goto ");
+    display_label(first_label + tags->len - 1);
+    displayln(";");
+    display_indent();
+    displayln("}");
+    nlabel += tags->len;
+    for (i = 0; i < tags->len; i++) {
+        if (i) {
+            read_token(TOK_WORD);
+            compile_or();
+        }
+        if (!is_shadowed_arm(tags, i) || (i == tags->len - 1)) {
+            display_label(first_label + i);
+            displayln(":");
+        }
+        compile_word(lookup_token(read_token(TOK_WORD), 0));
+    }
+    return 1;
+}
+
+static void compile_body_item(void)
+{
+    struct fusion *fusion;
+    struct token *tok;
+    struct local *local;
+    struct definition *inner_def;
+    int is_setter;
+
+    if (tokens_pos < tokens->len) {
+        display_line_directive(vec_get(tokens, tokens_pos));
+    }
+    if (compile_switch()) {
+        return;
+    } else if ((fusion = read_fusion())) {
+        compile_op(&fusion->op);
+    } else if ((tok = read_token(TOK_WORD))) {
+        if ((local = lookup_local_token(tok, &is_setter))) {
+            if (!is_setter) {
+                compile_local_fetch(local);
+            } else {
+                compile_local_store(local);
+            }
+        } else if ((inner_def = lookup_token(tok, 0))) {
+            if (inner_def->tag == DEF_COMPILE) {
+                inner_def->compile();
+            } else if ((inner_def->tag == DEF_PRIMITIVE)
+                || (inner_def->tag == DEF_USER)) {
+                compile_word(inner_def);
+            } else {
+                panic1("cannot use that in a definition:",
+                    token_string(tok));
+            }
+        } else {
+            panic1("not defined:", token_string(tok));
+        }
+    } else if ((tok = read_token(TOK_STRING))) {
+        vstack_push(copy_two_strings("(uintptr_t)(unsigned char *)\"",
+                        copy_two_strings(token_string(tok), "\"")),
+            0);
+    } else if ((tok = read_token(TOK_CHAR | TOK_UINT))) {
+        vstack_push_uintptr(tok->number, 0);
+    } else if ((tok = read_token(TOK_NEGINT))) {
+        vstack_push_uintptr(tok->number, 1);
+    } else {
+        panic("huh?");
+    }
+}
+
+static size_t find_end_of_body(void)
+{
+    size_t i;
+
+    for (i = tokens_pos; i < tokens->len; i++) {
+        if (token_is_word(vec_get(tokens, i), ";")) {
+            return i;
+        }
+    }
+    panic("definition is missing ;");
+}
+
+// A body ending in recurse is compiled into a loop.
+static int is_tail_recursive(size_t end)
+{
+    return (end != tokens_pos) && token_is_builtin(end - 1, "recurse");
+}
+
+// A body that compiled to no code and left only constants on the stack is
+// a constant word, and its uses push the values directly.
+static struct vec *constant_values(void)
+{
+    struct vec *constants;
+    struct entry *e;
+    size_t i;
+
+    for (i = 0; i < vstack->len; i++) {
+        e = vec_get(vstack, i);
+        if (e->range.lo != e->range.hi) {
+            return 0;
+        }
+    }
+    constants = vec_new(sizeof(uintptr_t));
+    for (i = 0; i < vstack->len; i++) {
+        e = vec_get(vstack, i);
+        *(uintptr_t *)vec_reserve(constants, 1) = e->range.lo;
+    }
+    return constants;
+}
+
+static uint64_t fnv_bytes(uint64_t hash, const char *bytes, size_t len)
+{
+    for (; len; len--, bytes++) {
+        hash = (hash ^ (unsigned char)*bytes) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t fnv_string(uint64_t hash, const char *str)
+{
+    return fnv_bytes(hash, str, strlen(str) + 1);
+}
+
+static uint64_t fnv_number(uint64_t hash, uint64_t n)
+{
+    char s[24];
+
+    snprintf(s, sizeof(s), "%" PRIu64, n);
+    return fnv_string(hash, s);
+}
+
+// What the code for the word at token pos depends on besides its name.
+static uint64_t reference_hash(
+    uint64_t hash, struct definition *def, size_t pos)
+{
+    struct unit *unit;
+    uintptr_t tag;
+    int has_exit;
+
+    hash = fnv_number(hash, def->tag);
+    hash = fnv_string(hash, def->forth_word);
+    if (def->tag != DEF_USER) {
+        return hash;
+    }
+    if (def->c_var_name) {
+        return fnv_string(fnv_string(hash, def->c_func_name),
+            def->c_var_name);
+    }
+    unit = vec_get(units, def->unit - 1);
+    hash = fnv_number(hash, unit->hash);
+    hash = fnv_number(hash, (uint64_t)def->noinline);
+    hash = fnv_number(hash, (uint64_t)can_inline(def, &has_exit));
+    return arm_tag(pos, &tag) ? fnv_number(hash, tag)
+                              : fnv_string(hash, "no tag");
+}
+
+// Code cached by another build of forthc may be out of date, so the cache
+// is keyed on the compiler's own executable too. Without /proc, argv[0]
+// usually names it. Returns 0 if the executable cannot be read.
+static int hash_compiler(const char *argv0)
+{
+    const char *exe;
+    size_t len;
+
+    if (!(exe = map_file("/proc/self/exe", &len))
+        && !(exe = map_file(argv0, &len))) {
+        return 0;
+    }
+    compiler_hash = fnv_bytes(FNV_OFFSET, exe, len);
+    if (len) {
+        munmap((void *)(uintptr_t)exe, len);
+    }
+    return 1;
+}
+
+// The tokens of a body, less whitespace and comments, and the hashes of
+// the words they refer to, which cover what those words refer to in turn.
+static uint64_t definition_hash(struct definition *def, size_t end)
+{
+    struct definition *dep;
+    struct token *tok;
+    uint64_t hash;
+    size_t i;
+
+    hash = fnv_string(FNV_OFFSET, CACHE_FORMAT);
+    hash = fnv_number(hash, compiler_hash);
+    hash = fnv_number(hash, inline_threshold);
+    hash = fnv_number(hash, (uint64_t)option_global_flag);
+    hash = fnv_number(hash, (uint64_t)option_registers);
+    hash = fnv_number(hash, (uint64_t)option_profile);
+    hash = fnv_number(hash, (uint64_t)(word_heat(def) + 1));
+    hash = fnv_string(hash, linkage);
+    hash = fnv_string(hash, def->c_func_name);
+    if (option_line_directives) {
+        hash = fnv_string(hash, source_name);
+        hash = fnv_number(hash,
+            ((struct token *)vec_get(tokens, def->name_token))->line);
+    }
+    for (i = def->body_start; i < end; i++) {
+        tok = vec_get(tokens, i);
+        if (option_line_directives || option_profile) {
+            hash = fnv_number(hash, tok->line);
+            hash = fnv_number(hash, tok->column);
+        }
+        hash = fnv_number(hash, (uint64_t)(exit_bias(tok) + 1));
+        hash = fnv_number(hash, tok->tag);
+        hash = fnv_number(hash, tok->length);
+        hash = fnv_bytes(hash, tok->string, tok->length);
+        if ((tok->tag == TOK_WORD) && (dep = lookup_token(tok, 0))) {
+            hash = reference_hash(hash, dep, i);
+        }
+    }
+    return hash;
+}
+
+static void cache_skip_spaces(void)
+{
+    while ((cache_pos < cache_len)
+        && isspace((unsigned char)cache[cache_pos])) {
+        cache_pos++;
+    }
+}
+
+static char *cache_word(void)
+{
+    size_t start;
+
+    cache_skip_spaces();
+    start = cache_pos;
+    while ((cache_pos < cache_len)
+        && !isspace((unsigned char)cache[cache_pos])) {
+        cache_pos++;
+    }
+    if (start == cache_pos) {
+        panic("cache file is corrupt");
+    }
+    return copy_string_span(cache + start, cache + cache_pos);
+}
+
+static void cache_expect(const char *word)
+{
+    char *found = cache_word();
+
+    if (strcmp(found, word)) {
+        panic("cache file is corrupt");
+    }
+    free(found);
+}
+
+static long cache_long(void)
+{
+    char *word = cache_word();
+    char *end;
+    long n;
+
+    n = strtol(word, &end, 10);
+    if (*end) {
+        panic("cache file is corrupt");
+    }
+    free(word);
+    return n;
+}
+
+static uintptr_t cache_uintptr(void)
+{
+    char *word = cache_word();
+    char *end;
+    uintptr_t n;
+
+    n = (uintptr_t)strtoumax(word, &end, 10);
+    if (*end || (word[0] == '-')) {
+        panic("cache file is corrupt");
+    }
+    free(word);
+    return n;
+}
+
+static size_t cache_unit(void)
+{
+    char *name = cache_word();
+    size_t unit;
+
+    if (!(unit = table_get(unit_names, name))) {
+        panic("cache file is corrupt");
+    }
+    free(name);
+    return unit;
+}
+
+// Index the entries of the cache by hash. A cache written by a different
+// version of the compiler is ignored.
+static void load_cache(void)
+{
+    const size_t format_len = strlen(CACHE_FORMAT);
+    char *word;
+
+    cache_index = table_new();
+    if (!(cache = map_file(option_cache, &cache_len))) {
+        return;
+    }
+    if ((cache_len <= format_len) || memcmp(cache, CACHE_FORMAT, format_len)
+        || (cache[format_len] != '\n')) {
+        return;
+    }
+    cache_pos = format_len;
+    for (;;) {
+        cache_skip_spaces();
+        if (cache_pos == cache_len) {
+            break;
+        }
+        cache_expect("word");
+        word = cache_word();
+        free(cache_word());
+        table_put(cache_index, word, cache_pos + 1);
+        free(word);
+        cache_expect("code");
+        cache_pos += (size_t)cache_uintptr() + 1;
+        if (cache_pos > cache_len) {
+            panic("cache file is corrupt");
+        }
+        while (strcmp((word = cache_word()), "end")) {
+            free(word);
+        }
+        free(word);
+    }
+}
+
+// The profile says which source it was made from, as a hash, and has a
+// line for each word that was called and for each exit that was run:
+//
+//     source HASH
+//     word CALLS SELF-TIME TOTAL-TIME NAME
+//     branch LINE COLUMN TAKEN NOT-TAKEN
+//
+// An exit that was inlined in several places has a line for each place. A
+// profile of some other source is no guide to this one, and is ignored.
+static void load_profile(void)
+{
+    struct word_profile *word;
+    struct exit_profile *branch;
+    uint64_t a, b, c;
+    size_t len, line, column, i;
+    const char *contents;
+    char *text, *next;
+    char key[48];
+    int n;
+
+    if (!(contents = map_file(option_use_profile, &len))) {
+        panic1("cannot open", option_use_profile);
+    }
+    text = copy_string_span(contents, contents + len);
+    if (strncmp(text, PROFILE_FORMAT "\n", strlen(PROFILE_FORMAT) + 1)) {
+        panic1("not a profile:", option_use_profile);
+    }
+    text += strlen(PROFILE_FORMAT) + 1;
+    snprintf(key, sizeof(key), "source %016" PRIx64 "\n",
+        fnv_bytes(FNV_OFFSET, source, source_len));
+    if (strncmp(text, key, strlen(key))) {
+        fprintf(stderr, "warning: %s is a profile of another source\n",
+            option_use_profile);
+        return;
+    }
+    word_profiles = table_new();
+    exit_profiles = table_new();
+    word_profile_counts = vec_new(sizeof(struct word_profile));
+    exit_profile_counts = vec_new(sizeof(struct exit_profile));
+    for (text += strlen(key); *text; text = next) {
+        if (!(next = strchr(text, '\n'))) {
+            panic1("profile is corrupt:", option_use_profile);
+        }
+        *next++ = 0;
+        if ((sscanf(text, "word %" SCNu64 " %" SCNu64 " %" SCNu64 " %n", &a,
+                 &b, &c, &n)
+                == 3)
+            && text[n]) {
+            if (!(i = table_get(word_profiles, text + n))) {
+                vec_reserve(word_profile_counts, 1);
+                i = word_profile_counts->len;
+                table_put(word_profiles, text + n, i);
+            }
+            word = vec_get(word_profile_counts, i - 1);
+            word->calls += a;
+            word->self += b;
+            profile_all_calls += a;
+            profile_all_self += b;
+        } else if (sscanf(text, "branch %zu %zu %" SCNu64 " %" SCNu64, &line,
+                       &column, &a, &b)
+            == 4) {
+            snprintf(key, sizeof(key), "%zu:%zu", line, column);
+            if (!(i = table_get(exit_profiles, key))) {
+                vec_reserve(exit_profile_counts, 1);
+                i = exit_profile_counts->len;
+                table_put(exit_profiles, key, i);
+            }
+            branch = vec_get(exit_profile_counts, i - 1);
+            branch->taken += a;
+            branch->not_taken += b;
+        } else {
+            panic1("profile is corrupt:", option_use_profile);
+        }
+    }
+}
+
+// Replay what compiling the definition did to the current unit, as saved
+// by write_cache.
+static void replay_cached(struct definition *def, size_t offset)
+{
+    struct unit *unit = vec_get(units, current_unit);
+    size_t n;
+    long arg;
+    int kind, flag;
+
+    cache_pos = offset - 1;
+    cache_expect("code");
+    n = (size_t)cache_uintptr();
+    if (++cache_pos + n > cache_len) {
+        panic("cache file is corrupt");
+    }
+    vec_putb(output, cache + cache_pos, n);
+    cache_pos += n;
+    cache_expect("uses");
+    for (n = (size_t)cache_uintptr(); n; n--) {
+        use_unit(cache_unit());
+    }
+    cache_expect("events");
+    for (n = (size_t)cache_uintptr(); n; n--) {
+        kind = (int)cache_long();
+        flag = (int)cache_long();
+        arg = (kind == STACK_CALL) ? (long)cache_unit() - 1 : cache_long();
+        record_stack_event(kind, arg)->flag = flag;
+    }
+    cache_expect("declared");
+    unit->declared = (int)cache_long();
+    unit->declared_in = cache_long();
+    unit->declared_out = cache_long();
+    cache_expect("quotes");
+    for (n = (size_t)cache_uintptr(); n; n--) {
+        quote_unit(cache_unit());
+    }
+    cache_expect("writes");
+    unit->writes_all = (int)cache_long();
+    for (n = (size_t)cache_uintptr(); n; n--) {
+        add_write(cache_word());
+    }
+    cache_expect("unchecked");
+    unit->unchecked = (size_t)cache_uintptr();
+    cache_expect("constants");
+    if (cache_long()) {
+        def->constants = vec_new(sizeof(uintptr_t));
+        for (n = (size_t)cache_uintptr(); n; n--) {
+            *(uintptr_t *)vec_reserve(def->constants, 1) = cache_uintptr();
+        }
+    }
+    cache_expect("end");
+}
+
+// A definition whose hash is in the cache is not compiled again.
+static int compile_cached(struct definition *def, size_t end)
+{
+    struct unit *unit = vec_get(units, current_unit);
+    char key[24];
+    size_t offset;
+
+    if (!cache_index) {
+        return 0;
+    }
+    snprintf(key, sizeof(key), "%016" PRIx64, unit->hash);
+    if (!(offset = table_get(cache_index, key))) {
+        return 0;
+    }
+    replay_cached(def, offset);
+    unit->constants = def->constants;
+    end_body(def, end);
+    tokens_pos = end + 1;
+    ncached++;
+    return 1;
+}
+
+// With -p each word is a wrapper that counts the calls and the time of
+// the function holding its body.
+static void display_profile_wrapper(struct definition *def)
+{
+    char *counter = copy_two_strings("profile_", def->c_func_name);
+
+    display("\nstatic struct profile_word ");
+    display(counter);
+    display(" = {.name = ");
+    flush_line_directive();
+    vec_put_c_string(output, def->forth_word);
+    displayln("};");
+    display_function_start(def->c_func_name);
+    display(indent);
+    display("profile_enter(&");
+    display(counter);
+    displayln(");");
+    display(indent);
+    display("profiled_");
+    display(def->c_func_name);
+    displayln("();");
+    display(indent);
+    displayln("profile_leave();");
+    displayln("}");
+    free(counter);
+}
+
+static void compile_top_level_definition(void)
+{
+    struct token *tok;
+    struct definition *def;
+    struct unit *unit;
+    size_t end;
+    size_t body_code_start;
+    size_t function_start;
+
+    if (!(tok = read_token(TOK_WORD))) {
+        panic("word name expected");
+    }
+    def = define_user(token_string(tok));
+    def->unit = begin_unit(def->forth_word, def->c_func_name);
+    current_definition = definition_index(def);
+    def->body_start = tokens_pos;
+    end = find_end_of_body();
+    unit = vec_get(units, current_unit);
+    unit->hash = definition_hash(def, end);
+    if (compile_cached(def, end)) {
+        return;
+    }
+    // Names are numbered per function, so that its code is the same
+    // wherever the definition is in the source.
+    table_clear(local_pool);
+    table_clear(local_suffixes);
+    nlabel = 0;
+    nexit = 0;
+    exit_counters->len = 0;
+    tail_call_end = SIZE_MAX;
+    function_start = output->len;
+    display_line_directive(tok);
+    if (option_profile && !option_shards) {
+        // The body of a recursive word calls the wrapper.
+        display(linkage);
+        display("void ");
+        display(def->c_func_name);
+        displayln("(void);");
+    }
+    display_heat_attribute(def);
+    if (option_profile) {
+        display("static void profiled_");
+        display(def->c_func_name);
+        displayln("(void) {");
+    } else {
+        display_function_start(def->c_func_name);
+    }
+    flag_decl_pos = output->len;
+    flag_used = flag_read = 0;
+    flag_in_local = flag_in_global = 1;
+    ntemp = 0;
+    depth = 1;
+    facts->len = 0;
+    exit_statement = return_statement;
+    if ((tail_recursive = is_tail_recursive(end))) {
+        displayln("top:");
+        displayln("    {");
+        depth++;
+        // Only lflag is brought up to date for each trip around the loop.
+        if (!option_global_flag && !option_registers) {
+            flag_in_global = 0;
+        }
+    }
+    body_code_start = output->len;
+    while (!read_the_word(";")) {
+        compile_body_item();
+    }
+    def = vec_get(definitions, current_definition);
+    if (output->len == body_code_start) {
+        def->constants = constant_values();
+        unit->constants = def->constants;
+    }
+    flush();
+    if (tail_recursive) {
+        depth--;
+        displayln("    }");
+    } else {
+        store_flag();
+        record_stack_event(STACK_RETURN, 0);
+        if (option_registers) {
+            display_return();
+        }
+    }
+    displayln("}");
+    // lflag can end up written but never read, when a primitive changes
+    // flag right after a comparison.
+    if (flag_used && !option_registers) {
+        vec_insert(output, flag_decl_pos,
+            flag_read ? "    bool lflag = flag;\n"
+                      : "    bool lflag = flag;\n    (void)lflag;\n");
+    }
+    if (exit_counters->len) {
+        vec_putc(exit_counters, 0);
+        vec_insert(output, function_start, (char *)exit_counters->bytes);
+    }
+    if (option_profile) {
+        display_line_directive(tok);
+        display_profile_wrapper(def);
+    }
+    rollback_locals();
+    end_body(def, tokens_pos - 1);
+}
+
+// Marks the definition that ends just before it.
+static void compile_top_level_noinline(void)
+{
+    struct definition *def = vec_get(definitions, current_definition);
+
+    if (!def->body_end || (def->body_end + 2 != tokens_pos)) {
+        panic("noinline must follow a definition");
+    }
+    def->noinline = 1;
+}
+
+static int is_stack_effect_declaration(void)
+{
+    struct token *tok;
+    size_t i;
+
+    for (i = tokens_pos; i < tokens->len; i++) {
+        tok = vec_get(tokens, i);
+        if (token_is_word(tok, ")")) {
+            break;
+        }
+        if (token_is_word(tok, "--")) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ( in... -- out... ) at the start of a body declares the stack effect
+// that the word must have. Inlined bodies always come before the body
+// being compiled, and their declarations have been checked already.
+static void compile_stack_effect_declaration(void)
+{
+    struct definition *def = vec_get(definitions, current_definition);
+    struct unit *unit = vec_get(units, current_unit);
+    size_t start = tokens_pos;
+    long nin = 0, nout = 0;
+    long *count = &nin;
+
+    while (!read_the_word(")")) {
+        if (read_the_word("--")) {
+            count = &nout;
+        } else if (read_token(TOK_WORD)) {
+            (*count)++;
+        } else {
+            panic("stack effect declaration expects names");
+        }
+    }
+    if (start <= def->body_start) {
+        return;
+    }
+    if (start != def->body_start + 1) {
+        panic1("stack effect must come first in", def->forth_word);
+    }
+    unit->declared = 1;
+    unit->declared_in = nin;
+    unit->declared_out = nout;
+}
+
+static void compile_parentheses(void)
+{
+    struct token *tok;
+    struct vec *buf;
+
+    if (read_the_word("byte:")) {
+        if (!read_token(TOK_STRING) || !read_the_word(")")) {
+            panic("byte: expects one string");
+        }
+    } else if (read_the_word("bytes:")) {
+        buf = vec_new(1);
+        while (!read_the_word(")")) {
+            if ((tok = read_token(TOK_STRING))) {
+                vec_putb(buf, tok->string, tok->length);
+            } else if ((tok = read_token(TOK_UINT))) {
+                intptr_t i = (intptr_t)tok->number;
+                if ((i < 0x00) || (i > 0xff)) {
+                    panic("byte out of range");
+                }
+                vec_putc(buf, (char)(unsigned char)i);
+            } else {
+                panic("bytes: expects strings and numbers");
+            }
+        }
+    } else if (is_stack_effect_declaration()) {
+        compile_stack_effect_declaration();
+    } else {
+        vec_mark(locals);
+        while (!read_the_word(")")) {
+            if ((tok = read_token(TOK_WORD))) {
+                add_local(token_string(tok));
+            } else {
+                panic("locals declaration expects names");
+            }
+        }
+        compile_locals();
+    }
+}
+
+static void compile_quote(void)
+{
+    struct definition *def;
+    struct token *tok;
+
+    if (!(tok = read_token(TOK_WORD))) {
+        panic("word name expected");
+    }
+    if (!(def = lookup_token(tok, DEF_USER))) {
+        panic1("not defined:", token_string(tok));
+    }
+    use_unit(def->unit);
+    quote_unit(def->unit);
+    vstack_push(copy_two_strings("(uintptr_t)", def->c_func_name), 0);
+}
+
+static void compile_and(void)
+{
+    compile_exit(copy_two_strings("!", read_flag()), 0);
+}
+
+static void compile_or(void) { compile_exit(read_flag(), 1); }
+
+static void compile_recurse(void)
+{
+    struct definition *def = vec_get(definitions, current_definition);
+    if (tail_recursive && token_is_word(vec_get(tokens, tokens_pos), ";")) {
+        flush();
+        load_flag();
+        record_stack_event(STACK_LOOP, 0);
+        display_indent();
+        displayln("goto top;");
+        return;
+    }
+    fprintf(stderr, "warning: recurse is not in tail position in %s\n",
+        def->forth_word);
+    store_flag();
+    compile_call(def);
+    record_call(def);
+    forget_variables(0);
+    clobber_flag();
+}
+
+// The threaded backend writes an image for forthi instead of C. Every use
+// of a word is a call, and each instruction goes on a line of its own:
+//
+//     word NAME        start of a word
+//     top              where a tail-recursive word loops back to
+//     loop             jump to top
+//     frame N          make room for N locals
+//     bind N           pop into local N (also used for its setter)
+//     local N          push local N
+//     variable NAME    reserve a cell for a variable
+//     var NAME         push a variable
+//     var! NAME        pop into a variable
+//     lit N            push N
+//     string N BYTES   push the address of N bytes
+//     quote NAME       push the address of a word
+//     call NAME        call a word
+//     execute          call the word whose address is popped
+//     and, or          return unless flag is set, or if it is
+//     exit             return
+//     prim_...         run a primitive
+static void emit(const char *op, const char *operand)
+{
+    vec_puts(image, op);
+    if (operand) {
+        vec_putc(image, ' ');
+        vec_puts(image, operand);
+    }
+    vec_putc(image, '\n');
+}
+
+static void emit_number(const char *op, uintptr_t n)
+{
+    char s[24];
+
+    snprintf(s, sizeof(s), "%" PRIuPTR, n);
+    emit(op, s);
+}
+
+// The C backend hands string literals to the C compiler as they are, so
+// the threaded backend decodes the same escapes that C does.
+static const char escape_letters[] = "abfnrtv\\'\"?";
+static const char escape_bytes[] = "\a\b\f\n\r\t\v\\'\"?";
+
+static int hex_digit_value(int c)
+{
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// A \u or \U escape names a character, written out in UTF-8.
+static void put_utf8(struct vec *bytes, unsigned long c)
+{
+    if (c < 0x80) {
+        vec_putc(bytes, (char)c);
+    } else if (c < 0x800) {
+        vec_putc(bytes, (char)(0xc0 | (c >> 6)));
+        vec_putc(bytes, (char)(0x80 | (c & 0x3f)));
+    } else if (c < 0x10000) {
+        vec_putc(bytes, (char)(0xe0 | (c >> 12)));
+        vec_putc(bytes, (char)(0x80 | ((c >> 6) & 0x3f)));
+        vec_putc(bytes, (char)(0x80 | (c & 0x3f)));
+    } else if (c < 0x110000) {
+        vec_putc(bytes, (char)(0xf0 | (c >> 18)));
+        vec_putc(bytes, (char)(0x80 | ((c >> 12) & 0x3f)));
+        vec_putc(bytes, (char)(0x80 | ((c >> 6) & 0x3f)));
+        vec_putc(bytes, (char)(0x80 | (c & 0x3f)));
+    } else {
+        panic("universal character name out of range");
+    }
+}
+
+static void emit_string(struct token *tok)
+{
+    struct vec *bytes = vec_new(sizeof(char));
+    const char *p = tok->string;
+    const char *limit = tok->string + tok->length;
+    const char *letter;
+    unsigned long c;
+    size_t n;
+
+    while (p < limit) {
+        if ((*p != '\\') || (p + 1 == limit)) {
+            vec_putc(bytes, *p++);
+            continue;
+        }
+        p++;
+        if ((letter = strchr(escape_letters, *p)) && *p) {
+            vec_putc(bytes, escape_bytes[letter - escape_letters]);
+            p++;
+        } else if ((*p >= '0') && (*p <= '7')) {
+            for (c = 0, n = 0; (n < 3) && (p < limit) && (*p >= '0')
+                 && (*p <= '7');
+                 n++) {
+                c = c * 8 + (unsigned long)(*p++ - '0');
+            }
+            if (c > 0xff) {
+                panic("octal escape out of range");
+            }
+            vec_putc(bytes, (char)c);
+        } else if (*p == 'x') {
+            p++;
+            for (c = 0, n = 0; (p < limit) && (hex_digit_value(*p) >= 0);
+                 n++) {
+                c = c * 16 + (unsigned long)hex_digit_value(*p++);
+                if (c > 0xff) {
+                    panic("hex escape out of range");
+                }
+            }
+            if (!n) {
+                panic("hex escape without digits");
+            }
+            vec_putc(bytes, (char)c);
+        } else if ((*p == 'u') || (*p == 'U')) {
+            n = (*p++ == 'u') ? 4 : 8;
+            for (c = 0; n; n--) {
+                if ((p == limit) || (hex_digit_value(*p) < 0)) {
+                    panic("incomplete universal character name");
+                }
+                c = c * 16 + (unsigned long)hex_digit_value(*p++);
+            }
+            put_utf8(bytes, c);
+        } else {
+            panic("unknown escape sequence");
+        }
+    }
+    vec_puts(image, "string ");
+    vec_putd(image, bytes->len);
+    vec_putc(image, ' ');
+    vec_putb(image, (char *)bytes->bytes, bytes->len);
+    vec_putc(image, '\n');
+}
+
+static size_t local_index(struct local *local)
+{
+    return (size_t)((unsigned char *)local - locals->bytes)
+        / locals->itemsize;
+}
+
+static void thread_top_level_variable(void)
+{
+    struct definition *def;
+    struct token *tok;
+    char *forth_word;
+    char *c_var_name;
+
+    if (!(tok = read_token(TOK_WORD))) {
+        panic("variable name expected");
+    }
+    forth_word = token_string(tok);
+    c_var_name = mangle("var_", forth_word);
+    emit("variable", c_var_name);
+
+    def = define_user(forth_word);
+    def->c_var_name = c_var_name;
+    def->nout = 1;
+    emit("word", def->c_func_name);
+    emit("var", c_var_name);
+    emit("exit", 0);
+
+    def = define_user(copy_two_strings(forth_word, "!"));
+    def->c_var_name = c_var_name;
+    def->nin = 1;
+    emit("word", def->c_func_name);
+    emit("var!", c_var_name);
+    emit("exit", 0);
+}
+
+static void thread_word(struct definition *def)
+{
+    if (def->c_var_name) {
+        emit(def->nin ? "var!" : "var", def->c_var_name);
+    } else if (def->tag == DEF_USER) {
+        emit("call", def->c_func_name);
+    } else if (def->calls_quoted) {
+        emit("execute", 0);
+    } else {
+        emit(def->c_func_name, 0);
+    }
+}
+
+static void thread_body_item(void)
+{
+    struct token *tok;
+    struct local *local;
+    struct definition *inner_def;
+    int is_setter;
+
+    if ((tok = read_token(TOK_WORD))) {
+        if ((local = lookup_local_token(tok, &is_setter))) {
+            emit_number(is_setter ? "bind" : "local", local_index(local));
+        } else if ((inner_def = lookup_token(tok, 0))) {
+            if (inner_def->tag == DEF_COMPILE) {
+                inner_def->compile();
+            } else if ((inner_def->tag == DEF_PRIMITIVE)
+                || (inner_def->tag == DEF_USER)) {
+                thread_word(inner_def);
+            } else {
+                panic1("cannot use that in a definition:",
+                    token_string(tok));
+            }
+        } else {
+            panic1("not defined:", token_string(tok));
+        }
+    } else if ((tok = read_token(TOK_STRING))) {
+        emit_string(tok);
+    } else if ((tok = read_token(TOK_CHAR | TOK_UINT))) {
+        emit_number("lit", tok->number);
+    } else if ((tok = read_token(TOK_NEGINT))) {
+        emit_number("lit", -tok->number);
+    } else {
+        panic("huh?");
+    }
+}
+
+// The frame is sized once the whole body has been seen.
+static void thread_top_level_definition(void)
+{
+    struct token *tok;
+    struct definition *def;
+    size_t frame_pos;
+    char frame[40];
+
+    if (!(tok = read_token(TOK_WORD))) {
+        panic("word name expected");
+    }
+    def = define_user(token_string(tok));
+    current_definition = definition_index(def);
+    def->body_start = tokens_pos;
+    tail_recursive = is_tail_recursive(find_end_of_body());
+    emit("word", def->c_func_name);
+    frame_pos = image->len;
+    frame_size = 0;
+    if (tail_recursive) {
+        emit("top", 0);
+    }
+    while (!read_the_word(";")) {
+        thread_body_item();
+    }
+    emit("exit", 0);
+    if (frame_size) {
+        snprintf(frame, sizeof(frame), "frame %zu\n", frame_size);
+        vec_insert(image, frame_pos, frame);
+    }
+    rollback_locals();
+    def = vec_get(definitions, current_definition);
+    def->body_end = tokens_pos - 1;
+}
+
+static void thread_parentheses(void)
+{
+    struct token *tok;
+    size_t i;
+
+    if (read_the_word("byte:")) {
+        if (!read_token(TOK_STRING) || !read_the_word(")")) {
+            panic("byte: expects one string");
+        }
+        return;
+    }
+    if (read_the_word("bytes:")) {
+        while (!read_the_word(")")) {
+            if ((tok = read_token(TOK_UINT))) {
+                if (tok->number > 0xff) {
+                    panic("byte out of range");
+                }
+            } else if (!read_token(TOK_STRING)) {
+                panic("bytes: expects strings and numbers");
+            }
+        }
+        return;
+    }
+    if (is_stack_effect_declaration()) {
+        while (!read_the_word(")")) {
+            if (!read_token(TOK_WORD)) {
+                panic("stack effect declaration expects names");
+            }
+        }
+        return;
+    }
+    vec_mark(locals);
+    while (!read_the_word(")")) {
+        if ((tok = read_token(TOK_WORD))) {
+            add_local(token_string(tok));
+        } else {
+            panic("locals declaration expects names");
+        }
+    }
+    for (i = locals->len; i > locals->mark; i--) {
+        emit_number("bind", i - 1);
+    }
+    if (frame_size < locals->len) {
+        frame_size = locals->len;
+    }
+}
+
+static void thread_quote(void)
+{
+    struct definition *def;
+    struct token *tok;
+
+    if (!(tok = read_token(TOK_WORD))) {
+        panic("word name expected");
+    }
+    if (!(def = lookup_token(tok, DEF_USER)) || def->c_var_name) {
+        panic1("not defined:", token_string(tok));
+    }
+    emit("quote", def->c_func_name);
+}
+
+static void thread_and(void) { emit("and", 0); }
+
+static void thread_or(void) { emit("or", 0); }
+
+static void thread_recurse(void)
+{
+    struct definition *def = vec_get(definitions, current_definition);
+
+    if (tail_recursive && token_is_word(vec_get(tokens, tokens_pos), ";")) {
+        emit("loop", 0);
+    } else {
+        emit("call", def->c_func_name);
+    }
+}
+
+// Compile words and top-level words that build images instead of C.
+static void define_threaded_words(void)
+{
+    define_compile_top_level("variable", thread_top_level_variable);
+    define_compile_top_level(":", thread_top_level_definition);
+    define_compile("(", thread_parentheses);
+    define_compile("'", thread_quote);
+    define_compile("&", thread_and);
+    define_compile("|", thread_or);
+    define_compile("recurse", thread_recurse);
+}
+
+// The x86-64 backend translates the threaded image into GNU assembler for
+// ELF targets. In the generated code the top of the stack is kept in %rbx,
+// %r12 points just past the cells under it, and %r13 holds flag. Constants,
+// locals, variables and addresses are held back as operands, the way the C
+// backend keeps entries, until something needs them on the stack. Short
+// primitives are open-coded. The others are called through C wrappers in
+// the companion header, with the registers stored back into stack and flag
+// around the call. A word's code is at fw_NAME, and main and the quoted
+// words also get an entry at NAME that can be called from C. Pushes run
+// into the guard page at the end of the stack. Open-coded pops compare
+// %r12 with stackbuf first and jump to .Lunderflow, unless the depth of
+// the stack has been verified. A comparison that decides a return leaves
+// flag in the condition codes, and %r13 is only set once it may be read.
+//
+// In the binary operators @ stands for the second operand, which is popped
+// into %rax unless it can be used as it is, and # for the first one. An
+// operator that replaces a held first operand computes into %rsi, and the
+// result stays held there.
+static const struct asm_op asm_binary_ops[] = {
+    { "prim_ne", "cmpq @, #\n", 1, 1, "ne", "e", 2 },
+    { "prim_eq", "cmpq @, #\n", 1, 1, "e", "ne", 2 },
+    { "prim_lt", "cmpq @, #\n", 1, 1, "b", "ae", 2 },
+    { "prim_le", "cmpq @, #\n", 1, 1, "be", "a", 2 },
+    { "prim_gt", "cmpq @, #\n", 1, 1, "a", "be", 2 },
+    { "prim_ge", "cmpq @, #\n", 1, 1, "ae", "b", 2 },
+    { "prim_ge_s", "cmpq @, #\n", 1, 1, "ge", "l", 2 },
+    { "prim_plus", "add @, #\njc .Loverflow\n", 1, 0, 0, 0, 2 },
+    { "prim_plus_s", "add @, #\njo .Loverflow\n", 1, 0, 0, 0, 2 },
+    { "prim_plus_carry", "add @, #\n", 1, 0, "c", "nc", 2 },
+    { "prim_minus", "sub @, #\njc .Loverflow\n", 1, 0, 0, 0, 2 },
+    { "prim_minus_s", "sub @, #\njo .Loverflow\n", 1, 0, 0, 0, 2 },
+    { "prim_star", "mul #\njc .Loverflow\nmov %rax, #\n", 0, 0, 0, 0, 2 },
+    { "prim_star_s", "imul @, #\njo .Loverflow\n", 1, 0, 0, 0, 2 },
+    { "prim_and_bits", "and @, #\n", 1, 0, 0, 0, 2 },
+    { "prim_or_bits", "or @, #\n", 1, 0, 0, 0, 2 },
+    { 0, 0, 0, 0, 0, 0, 0 },
+};
+
+// These work on the real stack.
+static const struct asm_op asm_ops[] = {
+    { "prim_flag", "mov %rbx, (%r12)\nadd $8, %r12\nmov %r13, %rbx\n", 0, 0,
+        0, 0, 0 },
+    { "prim_cells", "mov %rbx, %rax\nshr $61, %rax\njnz .Loverflow\n"
+                    "shl $3, %rbx\n",
+        0, 0, 0, 0, 1 },
+    { "prim_fetch", "mov (%rbx), %rbx\n", 0, 0, 0, 0, 1 },
+    { "prim_byte_fetch", "movzbl (%rbx), %ebx\n", 0, 0, 0, 0, 1 },
+    { "prim_store", "mov -8(%r12), %rax\nmov %rax, (%rbx)\n"
+                    "sub $16, %r12\nmov (%r12), %rbx\n",
+        0, 0, 0, 0, 2 },
+    { "prim_byte_store", "mov -8(%r12), %rax\nmov %al, (%rbx)\n"
+                         "sub $16, %r12\nmov (%r12), %rbx\n",
+        0, 0, 0, 0, 2 },
+    { 0, 0, 0, 0, 0, 0, 0 },
+};
+
+static const struct asm_op *find_asm_op(
+    const struct asm_op *ops, const char *prim)
+{
+    for (; ops->prim; ops++) {
+        if (!strcmp(ops->prim, prim)) {
+            return ops;
+        }
+    }
+    return 0;
+}
+
+// Each line of the template is indented, and @ and # are replaced.
+static void display_asm2(
+    const char *template, const char *second, const char *first)
+{
+    const char *p;
+
+    for (p = template; *p; p++) {
+        if ((p == template) || (p[-1] == '\n')) {
+            display(indent);
+        }
+        if (*p == '@') {
+            display(second);
+        } else if (*p == '#') {
+            display(first);
+        } else {
+            vec_putc(output, *p);
+        }
+    }
+}
+
+static void display_asm(const char *template, const char *operand)
+{
+    display_asm2(template, operand, 0);
+}
+
+static int is_imm32(uintptr_t n)
+{
+    return ((intptr_t)n >= INT32_MIN) && ((intptr_t)n <= INT32_MAX);
+}
+
+// The first locals live in callee-saved registers, which the word saves,
+// and the rest in its frame.
+static char *asm_local_operand(uintptr_t index)
+{
+    static const char *const regs[ASM_LOCAL_REGS] = { "%r14", "%r15" };
+    char s[32];
+
+    if (index < ASM_LOCAL_REGS) {
+        return copy_string(regs[index]);
+    }
+    snprintf(s, sizeof(s), "%" PRIuPTR "(%%rsp)",
+        8 * (index - ASM_LOCAL_REGS));
+    return copy_string(s);
+}
+
+// An operand that instructions can use without loading it into a register
+// first, or null.
+static char *asm_operand(const struct asm_item *item)
+{
+    char s[32];
+
+    if ((item->kind == ASM_IMMEDIATE) && is_imm32(item->value)) {
+        snprintf(s, sizeof(s), "$%" PRIdPTR, (intptr_t)item->value);
+    } else if (item->kind == ASM_LOCAL) {
+        return asm_local_operand(item->value);
+    } else if (item->kind == ASM_VARIABLE) {
+        return copy_two_strings(item->name, "(%rip)");
+    } else if (item->kind == ASM_RESULT) {
+        return copy_string("%rsi");
+    } else if (item->kind == ASM_REGISTER) {
+        return copy_string(item->name);
+    } else {
+        return 0;
+    }
+    return copy_string(s);
+}
+
+static int is_memory_operand(const struct asm_item *item)
+{
+    return ((item->kind == ASM_LOCAL) && (item->value >= ASM_LOCAL_REGS))
+        || (item->kind == ASM_VARIABLE);
+}
+
+static int is_register_operand(const struct asm_item *item)
+{
+    return ((item->kind == ASM_LOCAL) && (item->value < ASM_LOCAL_REGS))
+        || (item->kind == ASM_RESULT) || (item->kind == ASM_REGISTER);
+}
+
+// A tail loop that calls nothing keeps the variables it uses in the
+// caller-saved registers. They are loaded at the top of the loop, and
+// stored back where it returns.
+static const char *asm_loop_var_register(const char *name)
+{
+    static const char *const regs[ASM_LOOP_VAR_REGS]
+        = { "%r8", "%r9", "%r10", "%r11" };
+    size_t i;
+
+    for (i = 0; asm_in_loop && (i < asm_nloop_vars); i++) {
+        if (!strcmp(asm_loop_vars[i], name)) {
+            return regs[i];
+        }
+    }
+    return 0;
+}
+
+// Finds the variables that the tail loop starting at p can keep in
+// registers, if it has no calls.
+static void asm_find_loop_vars(const char *p)
+{
+    char *op;
+    char *operand;
+    size_t i;
+
+    asm_nloop_vars = 0;
+    for (; strncmp(p, "loop\n", 5); p += strcspn(p, "\n") + 1) {
+        op = copy_string_span(p, p + strcspn(p, " \n"));
+        if (!strcmp(op, "var") || !strcmp(op, "var!")) {
+            operand = copy_string_span(p + strlen(op) + 1,
+                p + strcspn(p, "\n"));
+            for (i = 0; i < asm_nloop_vars; i++) {
+                if (!strcmp(asm_loop_vars[i], operand)) {
+                    break;
+                }
+            }
+            if ((i == asm_nloop_vars) && (i < ASM_LOOP_VAR_REGS)) {
+                asm_loop_vars[asm_nloop_vars++] = operand;
+            }
+        } else if (strcmp(op, "local") && strcmp(op, "bind")
+            && strcmp(op, "lit") && strcmp(op, "quote")
+            && strcmp(op, "and") && strcmp(op, "or")
+            && strcmp(op, "prim_dup") && strcmp(op, "prim_drop")
+            && strcmp(op, "prim_cell_bits")
+            && !find_asm_op(asm_binary_ops, op)
+            && !find_asm_op(asm_ops, op)) {
+            asm_nloop_vars = 0;
+            return;
+        }
+    }
+}
+
+// Moves the loop's variables between memory and their registers.
+static void asm_sync_loop_vars(int load)
+{
+    size_t i;
+
+    for (i = 0; asm_in_loop && (i < asm_nloop_vars); i++) {
+        display_asm2(load ? "mov @(%rip), #\n" : "mov #, @(%rip)\n",
+            asm_loop_vars[i], asm_loop_var_register(asm_loop_vars[i]));
+    }
+}
+
+static void asm_load(const struct asm_item *item, const char *reg)
+{
+    char s[32];
+
+    if (item->kind == ASM_ADDRESS) {
+        display_asm2("lea @(%rip), #\n", item->name, reg);
+    } else if ((item->kind == ASM_IMMEDIATE) && !is_imm32(item->value)) {
+        snprintf(s, sizeof(s), "$%" PRIuPTR, item->value);
+        display_asm2("movabs @, #\n", s, reg);
+    } else {
+        display_asm2("mov @, #\n", asm_operand(item), reg);
+    }
+}
+
+static const char asm_pop_code[] = "    sub $8, %r12\n    mov (%r12), %rbx\n";
+
+static void asm_pop(void) { display(asm_pop_code); }
+
+// Makes sure that the real stack holds at least the given number of cells
+// under the held operands, as check_pop does in C.
+static void asm_need(size_t cells)
+{
+    char s[32];
+
+    if (!asm_check_pops || (cells <= asm_nheld)) {
+        return;
+    }
+    cells -= asm_nheld;
+    if (cells == 1) {
+        display_asm("cmp stackbuf(%rip), %r12\njbe .Lunderflow\n", 0);
+        return;
+    }
+    snprintf(s, sizeof(s), "-%zu(%%r12)", 8 * (cells - 1));
+    display_asm("lea @, %rcx\ncmp stackbuf(%rip), %rcx\njbe .Lunderflow\n",
+        s);
+}
+
+// Takes back a pop that was the last thing emitted.
+static int asm_unpop(void)
+{
+    size_t len = strlen(asm_pop_code);
+
+    if ((output->len < len)
+        || memcmp(output->bytes + output->len - len, asm_pop_code, len)) {
+        return 0;
+    }
+    output->len -= len;
+    return 1;
+}
+
+// Puts the held operands on the real stack, but leaves them held, for a
+// path that returns. If the top was just popped, its old cell is reused
+// and there is no need to store %rbx.
+static void asm_flush_copy(void)
+{
+    size_t base = 1;
+    char s[32];
+    size_t i;
+
+    if (!asm_nheld) {
+        return;
+    }
+    if (asm_unpop()) {
+        base = 0;
+    } else {
+        display_asm("mov %rbx, (%r12)\n", 0);
+    }
+    for (i = 0; i + 1 < asm_nheld; i++) {
+        asm_load(&asm_held[i], "%rcx");
+        snprintf(s, sizeof(s), "%zu(%%r12)", 8 * (base + i));
+        display_asm("mov %rcx, @\n", s);
+    }
+    if (base + i) {
+        snprintf(s, sizeof(s), "$%zu", 8 * (base + i));
+        display_asm("add @, %r12\n", s);
+    }
+    asm_load(&asm_held[asm_nheld - 1], "%rbx");
+}
+
+static void asm_flush(void)
+{
+    asm_flush_copy();
+    asm_nheld = 0;
+}
+
+static void asm_hold(int kind, uintptr_t value, const char *name)
+{
+    struct asm_item *item;
+
+    if (asm_nheld == MAX_HELD) {
+        asm_flush();
+    }
+    item = &asm_held[asm_nheld++];
+    item->kind = kind;
+    item->value = value;
+    item->name = name;
+}
+
+static int asm_holds(int kind, uintptr_t value, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < asm_nheld; i++) {
+        if ((asm_held[i].kind == kind) && (asm_held[i].value == value)
+            && (!name || !strcmp(asm_held[i].name, name))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Turns "mov dest, %rsi" and "add x, %rsi" just before, and any overflow
+// check after them, into "add x, dest" when the result goes back to dest.
+static int asm_update_in_place(const char *dest)
+{
+    static const char *const ops[] = { "add ", "sub ", "and ", "or ", 0 };
+    char *start = (char *)output->bytes;
+    char *end = start + output->len;
+    char *lines[3];
+    char *load, *op, *code;
+    size_t n, k, i;
+
+    for (n = 0; (n < 3) && (end > start); n++) {
+        do {
+            end--;
+        } while ((end > start) && (end[-1] != '\n'));
+        lines[n] = end;
+    }
+    k = (n && !strncmp(lines[0], "    j", 5)) ? 1 : 0;
+    if (n < k + 2) {
+        return 0;
+    }
+    op = lines[k];
+    load = copy_two_strings(copy_two_strings("    mov ", dest), ", %rsi\n");
+    if ((lines[k + 1] + strlen(load) != op)
+        || strncmp(lines[k + 1], load, strlen(load))
+        || strncmp(op + strcspn(op, "\n") - 6, ", %rsi", 6)) {
+        return 0;
+    }
+    for (i = 0; ops[i] && strncmp(op + 4, ops[i], strlen(ops[i])); i++) {
+    }
+    if (!ops[i]) {
+        return 0;
+    }
+    code = copy_string_span(op, op + strcspn(op, "\n") - 4);
+    code = copy_two_strings(copy_two_strings(code, dest), "\n");
+    code = copy_two_strings(code, k ? lines[0] : "");
+    output->len = (size_t)(lines[k + 1] - start);
+    vec_puts(output, code);
+    return 1;
+}
+
+// Pops into dest, which held operands below the top must not refer to.
+static void asm_pop_into(const char *dest)
+{
+    struct asm_item *item;
+
+    if (!asm_nheld) {
+        asm_need(1);
+        display_asm("mov %rbx, @\n", dest);
+        asm_pop();
+        return;
+    }
+    item = &asm_held[--asm_nheld];
+    if ((item->kind == ASM_IMMEDIATE) && is_imm32(item->value)) {
+        display_asm2("movq @, #\n", asm_operand(item), dest);
+    } else if ((item->kind == ASM_RESULT) && (*dest == '%')
+        && asm_update_in_place(dest)) {
+        // done
+    } else if (*dest == '%') {
+        asm_load(item, dest);
+    } else if (is_register_operand(item)) {
+        display_asm2("mov @, #\n", asm_operand(item), dest);
+    } else {
+        asm_load(item, "%rax");
+        display_asm("mov %rax, @\n", dest);
+    }
+}
+
+static void asm_save_state(void)
+{
+    display_asm("mov %rbx, (%r12)\nlea 8(%r12), %rax\n"
+                "mov %rax, stack(%rip)\nmov %r13b, flag(%rip)\n",
+        0);
+}
+
+static void asm_load_state(void)
+{
+    display_asm("mov stack(%rip), %r12\nsub $8, %r12\nmov (%r12), %rbx\n"
+                "movzbl flag(%rip), %r13d\n",
+        0);
+}
+
+// C functions expect the stack aligned to 16 bytes, and %rbp keeps the
+// unaligned value across the call.
+static void asm_call_c(const char *c_func_name)
+{
+    asm_flush();
+    asm_save_state();
+    display_asm("mov %rsp, %rbp\nand $-16, %rsp\ncall @\nmov %rbp, %rsp\n",
+        c_func_name);
+    asm_load_state();
+}
+
+static int is_noreturn_prim(const char *prim)
+{
+    struct definition *def;
+    size_t i;
+
+    for (i = 0; i < definitions->len; i++) {
+        def = vec_get(definitions, i);
+        if ((def->tag == DEF_PRIMITIVE) && !strcmp(def->c_func_name, prim)) {
+            return def->noreturn;
+        }
+    }
+    return 0;
+}
+
+// Calls a primitive that is not open-coded, through a wrapper that gets
+// declared and defined in the header the first time.
+static void asm_call_prim(const char *prim, struct vec *header)
+{
+    char *wrapper = copy_two_strings("forth_", prim);
+
+    if (!table_get(asm_names, wrapper)) {
+        table_put(asm_names, wrapper, 1);
+        vec_puts(header, "void ");
+        vec_puts(header, wrapper);
+        vec_puts(header, is_noreturn_prim(prim)
+                ? "(void) __attribute__((__noreturn__));\nvoid "
+                : "(void);\nvoid ");
+        vec_puts(header, wrapper);
+        vec_puts(header, "(void) { ");
+        vec_puts(header, prim);
+        vec_puts(header, "(); }\n");
+    }
+    asm_call_c(wrapper);
+}
+
+static void asm_prologue(size_t frame)
+{
+    char s[32];
+
+    display_asm("push %r14\n", 0);
+    if (frame > 1) {
+        display_asm("push %r15\n", 0);
+    }
+    if (frame > ASM_LOCAL_REGS) {
+        snprintf(s, sizeof(s), "$%zu", 8 * (frame - ASM_LOCAL_REGS));
+        display_asm("sub @, %rsp\n", s);
+    }
+}
+
+static void asm_return(size_t frame)
+{
+    char s[32];
+
+    asm_flush_copy();
+    asm_sync_loop_vars(0);
+    if (frame > ASM_LOCAL_REGS) {
+        snprintf(s, sizeof(s), "$%zu", 8 * (frame - ASM_LOCAL_REGS));
+        display_asm("add @, %rsp\n", s);
+    }
+    if (frame > 1) {
+        display_asm("pop %r15\n", 0);
+    }
+    if (frame) {
+        display_asm("pop %r14\n", 0);
+    }
+    display_asm("ret\n", 0);
+}
+
+static char *word_code_name(const char *c_func_name)
+{
+    return copy_two_strings("fw_", c_func_name);
+}
+
+static void asm_entry(const char *c_func_name, int is_global)
+{
+    if (is_global) {
+        display("\n    .globl ");
+        displayln(c_func_name);
+    } else {
+        newline();
+    }
+    display(c_func_name);
+    displayln(":");
+    display_asm("push %rbx\npush %r12\npush %r13\npush %rbp\n", 0);
+    asm_load_state();
+    display_asm("call @\n", word_code_name(c_func_name));
+    asm_save_state();
+    display_asm("pop %rbp\npop %r13\npop %r12\npop %rbx\nret\n", 0);
+}
+
+static void asm_string(
+    struct vec *data, const char *bytes, size_t len, const char *label)
+{
+    size_t i;
+
+    vec_puts(data, "\n    .section .rodata\n");
+    vec_puts(data, label);
+    vec_putc(data, ':');
+    for (i = 0; i < len; i++) {
+        vec_puts(data, (i % 16) ? "," : "\n    .byte ");
+        vec_putd(data, (unsigned char)bytes[i]);
+    }
+    vec_putc(data, '\n');
+}
+
+// Returns the condition code that the operator leaves flag in, if any.
+static const struct asm_op *asm_binary_op(const struct asm_op *op)
+{
+    const char *second = "%rax";
+    const char *first = "%rbx";
+    struct asm_item *item;
+
+    asm_need(op->cells);
+    if (asm_nheld && op->direct && asm_operand(&asm_held[asm_nheld - 1])) {
+        second = asm_operand(&asm_held[--asm_nheld]);
+    } else if (asm_nheld) {
+        asm_load(&asm_held[--asm_nheld], "%rax");
+    } else {
+        display_asm("mov %rbx, %rax\n", 0);
+        asm_pop();
+    }
+    if (op->keeps_first && asm_nheld) {
+        item = &asm_held[asm_nheld - 1];
+        if (is_memory_operand(item)
+                ? ((*second == '%') || (*second == '$'))
+                : is_register_operand(item)) {
+            first = asm_operand(item);
+        } else {
+            asm_load(item, "%rdx");
+            first = "%rdx";
+        }
+    } else if (!op->keeps_first && op->direct && asm_nheld
+        && strcmp(second, "%rsi") && !asm_holds(ASM_RESULT, 0, 0)) {
+        item = &asm_held[asm_nheld - 1];
+        asm_load(item, "%rsi");
+        item->kind = ASM_RESULT;
+        item->value = 0;
+        item->name = 0;
+        first = "%rsi";
+    } else if (!op->keeps_first) {
+        asm_flush();
+    }
+    display_asm2(op->code, second, first);
+    if (op->cc) {
+        asm_flag = -1;
+    }
+    return op->cc ? op : 0;
+}
+
+// Returns unless flag is set (and) or if it is (or). A comparison just
+// before leaves flag in the condition codes as well. The return goes after
+// the word so that the path that carries on falls through.
+static void asm_exit_if(const char *op, const struct asm_op *cc_op,
+    size_t frame)
+{
+    int is_and = !strcmp(op, "and");
+    struct vec *text = output;
+    char label[32];
+
+    snprintf(label, sizeof(label), ".Lexit%zu", asm_nexit++);
+    if (cc_op) {
+        display_asm2("j@ #\n", is_and ? cc_op->ncc : cc_op->cc, label);
+    } else {
+        display_asm2(is_and ? "test %r13d, %r13d\njz #\n"
+                            : "test %r13d, %r13d\njnz #\n",
+            0, label);
+    }
+    output = asm_exits;
+    display(label);
+    displayln(":");
+    if (cc_op) {
+        display_asm(is_and ? "xor %r13d, %r13d\n" : "mov $1, %r13d\n", 0);
+    }
+    asm_return(frame);
+    output = text;
+    if (cc_op) {
+        asm_flag = is_and;
+    }
+}
+
+static int asm_may_read_flag(const char *op)
+{
+    static const char *const ops[] = { "string", "local", "lit", "var",
+        "var!", "bind", "loop", "prim_dup", "prim_drop", 0 };
+    size_t i;
+
+    for (i = 0; ops[i]; i++) {
+        if (!strcmp(op, ops[i])) {
+            return 0;
+        }
+    }
+    return !find_asm_op(asm_binary_ops, op);
+}
+
+// Puts flag in %r13 if only its value is known.
+static void asm_settle_flag(void)
+{
+    if (asm_flag >= 0) {
+        display_asm(asm_flag ? "mov $1, %r13d\n" : "xor %r13d, %r13d\n", 0);
+        asm_flag = -1;
+    }
+}
+
+static void asm_instruction(
+    const char *op, const char *operand, struct vec *header, size_t frame)
+{
+    const struct asm_op *asm_op;
+
+    if (!strcmp(op, "local")) {
+        asm_hold(ASM_LOCAL, strtoul(operand, 0, 10), 0);
+    } else if (!strcmp(op, "bind")) {
+        if (asm_holds(ASM_LOCAL, strtoul(operand, 0, 10), 0)) {
+            asm_flush();
+        }
+        asm_pop_into(asm_local_operand(strtoul(operand, 0, 10)));
+    } else if (!strcmp(op, "var") && asm_loop_var_register(operand)) {
+        asm_hold(ASM_REGISTER, 0, asm_loop_var_register(operand));
+    } else if (!strcmp(op, "var")) {
+        asm_hold(ASM_VARIABLE, 0, operand);
+    } else if (!strcmp(op, "var!") && asm_loop_var_register(operand)) {
+        if (asm_holds(ASM_REGISTER, 0, asm_loop_var_register(operand))) {
+            asm_flush();
+        }
+        asm_pop_into(asm_loop_var_register(operand));
+    } else if (!strcmp(op, "var!")) {
+        if (asm_holds(ASM_VARIABLE, 0, operand)) {
+            asm_flush();
+        }
+        asm_pop_into(copy_two_strings(operand, "(%rip)"));
+    } else if (!strcmp(op, "lit")) {
+        asm_hold(ASM_IMMEDIATE, strtoull(operand, 0, 10), 0);
+    } else if (!strcmp(op, "quote")) {
+        asm_hold(ASM_ADDRESS, 0, operand);
+    } else if (!strcmp(op, "call")) {
+        asm_flush();
+        display_asm("call @\n", word_code_name(operand));
+    } else if (!strcmp(op, "execute")) {
+        asm_call_prim("prim_call", header);
+    } else if (!strcmp(op, "exit")) {
+        asm_return(frame);
+        asm_nheld = 0;
+    } else if (!strcmp(op, "prim_dup") && asm_nheld) {
+        asm_hold(asm_held[asm_nheld - 1].kind, asm_held[asm_nheld - 1].value,
+            asm_held[asm_nheld - 1].name);
+    } else if (!strcmp(op, "prim_dup")) {
+        asm_need(1);
+        display_asm("mov %rbx, (%r12)\nadd $8, %r12\n", 0);
+    } else if (!strcmp(op, "prim_drop") && asm_nheld) {
+        asm_nheld--;
+    } else if (!strcmp(op, "prim_drop")) {
+        asm_need(1);
+        asm_pop();
+    } else if (!strcmp(op, "prim_cell_bits")) {
+        asm_hold(ASM_IMMEDIATE, 64, 0);
+    } else if ((asm_op = find_asm_op(asm_ops, op))) {
+        asm_need(asm_op->cells);
+        asm_flush();
+        display_asm(asm_op->code, 0);
+    } else {
+        asm_call_prim(op, header);
+    }
+}
+
+// A tail-recursive word loops back to just after the binds of its
+// parameters, and the loop binds them from the held operands itself.
+static void asm_top_label(size_t nword)
+{
+    if (asm_nloop_vars) {
+        asm_flush();
+        asm_in_loop = 1;
+        asm_sync_loop_vars(1);
+    }
+    display(".Ltop");
+    display_uintptr(nword);
+    displayln(":");
+}
+
+// Returns the assembly, and adds the declarations and wrappers it needs to
+// header.
+static struct vec *translate_image(struct vec *header)
+{
+    struct vec *text = vec_new(sizeof(char));
+    struct vec *data = vec_new(sizeof(char));
+    struct vec *entries = vec_new(sizeof(char *));
+    struct vec *loop_binds = vec_new(sizeof(char *));
+    struct definition *def = lookup("main", DEF_USER);
+    const char *p = (char *)image->bytes;
+    const char *limit = p + image->len;
+    const struct asm_op *binary_op;
+    const struct asm_op *cc_op = 0;
+    char *op, *operand, *end, *label;
+    char *last_call = 0;
+    const char *q;
+    size_t last_call_pos = 0;
+    size_t binds_left = 0;
+    size_t frame = 0;
+    size_t nstring = 0;
+    size_t nword = 0;
+    int unreachable = 0;
+    size_t len, i;
+    char s[32];
+
+    asm_exits = vec_new(sizeof(char));
+    output = text;
+    displayln("    .text");
+    if (def) {
+        *(char **)vec_reserve(entries, 1) = def->c_func_name;
+        table_put(asm_names, def->c_func_name, 2);
+    }
+    p = (const char *)memchr(p, '\n', (size_t)(limit - p)) + 1;
+    while (p < limit) {
+        op = copy_string_span(p, p + strcspn(p, " \n"));
+        p += strlen(op);
+        operand = 0;
+        binary_op = find_asm_op(asm_binary_ops, op);
+        if (cc_op && strcmp(op, "and") && strcmp(op, "or")) {
+            display_asm("set@ %r13b\nmovzbl %r13b, %r13d\n", cc_op->cc);
+        }
+        if (asm_may_read_flag(op)) {
+            asm_settle_flag();
+        }
+        if (!strcmp(op, "string")) {
+            len = strtoul(p + 1, &end, 10);
+            snprintf(s, sizeof(s), ".Lstring%zu", nstring++);
+            label = copy_string(s);
+            asm_string(data, end + 1, len, label);
+            asm_hold(ASM_ADDRESS, 0, label);
+            p = end + 1 + len + 1;
+            cc_op = 0;
+            last_call = 0;
+            unreachable = 0;
+            continue;
+        }
+        if (*p == ' ') {
+            operand = copy_string_span(p + 1, p + strcspn(p, "\n"));
+            p += 1 + strlen(operand);
+        }
+        p++;
+        if (!strcmp(op, "exit") && unreachable) {
+            // after loop
+        } else if (!strcmp(op, "exit") && last_call && !frame) {
+            text->len = last_call_pos;
+            display_asm("jmp @\n", word_code_name(last_call));
+        } else if (binary_op) {
+            binary_op = asm_binary_op(binary_op);
+        } else if (!strcmp(op, "and") || !strcmp(op, "or")) {
+            asm_exit_if(op, cc_op, frame);
+        } else if (!strcmp(op, "word")) {
+            vec_putb(text, (char *)asm_exits->bytes, asm_exits->len);
+            asm_exits->len = 0;
+            frame = 0;
+            nword++;
+            asm_nloop_vars = 0;
+            asm_in_loop = 0;
+            display("\n    .p2align 4\n");
+            display(word_code_name(operand));
+            displayln(":");
+            record_symbol(word_code_name(operand), operand);
+        } else if (!strcmp(op, "frame")) {
+            frame = strtoul(operand, 0, 10);
+            asm_prologue(frame);
+        } else if (!strcmp(op, "top")) {
+            asm_find_loop_vars(p);
+            loop_binds->len = 0;
+            for (q = p; !strncmp(q, "bind ", 5); q += strcspn(q, "\n") + 1) {
+                *(char **)vec_reserve(loop_binds, 1)
+                    = copy_string_span(q + 5, q + strcspn(q, "\n"));
+            }
+            if (!(binds_left = loop_binds->len)) {
+                asm_top_label(nword);
+            }
+        } else if (!strcmp(op, "loop")) {
+            for (i = 0; i < loop_binds->len; i++) {
+                asm_instruction("bind", *(char **)vec_get(loop_binds, i),
+                    header, frame);
+            }
+            asm_flush();
+            asm_settle_flag();
+            display("    jmp .Ltop");
+            display_uintptr(nword);
+            newline();
+        } else if (!strcmp(op, "variable")) {
+            vec_puts(data, "\n    .bss\n    .p2align 3\n");
+            vec_puts(data, operand);
+            vec_puts(data, ":\n    .zero 8\n");
+            record_symbol(operand, operand);
+        } else {
+            if (!strcmp(op, "quote") && !table_get(asm_names, operand)) {
+                *(char **)vec_reserve(entries, 1) = operand;
+                table_put(asm_names, operand, 2);
+            }
+            if (!strcmp(op, "call")) {
+                asm_flush();
+                last_call_pos = text->len;
+            }
+            asm_instruction(op, operand, header, frame);
+            if (!strcmp(op, "bind") && binds_left && !--binds_left) {
+                asm_top_label(nword);
+            }
+        }
+        cc_op = binary_op;
+        last_call = !strcmp(op, "call") ? operand : 0;
+        unreachable = !strcmp(op, "loop");
+    }
+    vec_putb(text, (char *)asm_exits->bytes, asm_exits->len);
+    for (i = 0; i < entries->len; i++) {
+        asm_entry(*(char **)vec_get(entries, i), def && !i);
+        record_symbol(*(char **)vec_get(entries, i),
+            *(char **)vec_get(entries, i));
+    }
+    displayln("\n.Loverflow:");
+    display_asm("and $-16, %rsp\ncall forth_overflow\n", 0);
+    displayln("\n.Lunderflow:");
+    display_asm("and $-16, %rsp\ncall forth_underflow\n", 0);
+    vec_putb(text, (char *)data->bytes, data->len);
+    displayln("\n    .section .note.GNU-stack,\"\",@progbits");
+    return text;
+}
+
+static int compile_top_level(void)
+{
+    struct definition *def;
+    struct token *tok;
+
+    if (read_token(TOK_EOF))
+        return 0;
+    if (!(tok = read_token(TOK_WORD)))
+        panic("unknown top-level syntax");
+    if (!(def = lookup_token(tok, DEF_TOP_LEVEL)))
+        panic1("no top-level definition: ", token_string(tok));
+    def->compile();
+    return 1;
+}
+
+// Without a main the source is a library, and everything is kept.
+static void mark_live_units(void)
+{
+    struct definition *def = lookup("main", 0);
+    struct vec *work = vec_new(sizeof(size_t));
+    struct unit *unit;
+    size_t i;
+
+    if (!def || !def->unit) {
+        for (i = 0; i < units->len; i++) {
+            ((struct unit *)vec_get(units, i))->live = 1;
+        }
+        return;
+    }
+    *(size_t *)vec_reserve(work, 1) = def->unit - 1;
+    while (work->len) {
+        unit = vec_get(units, *(size_t *)vec_get(work, --work->len));
+        if (unit->live) {
+            continue;
+        }
+        unit->live = 1;
+        for (i = 0; i < unit->uses->len; i++) {
+            *(size_t *)vec_reserve(work, 1)
+                = *(size_t *)vec_get(unit->uses, i);
+        }
+    }
+}
+
+// The header is included twice by the runtime: first with FORTH_CONFIG
+// defined, to size the stack, and then for the code.
+static void list_dropped_units(void)
+{
+    struct unit *unit;
+    size_t i;
+
+    for (i = 0; i < units->len; i++) {
+        unit = vec_get(units, i);
+        if (!unit->live && unit->forth_word) {
+            fprintf(stderr, "dropped %s\n", unit->forth_word);
+        }
+    }
+}
+
+static void write_config(struct vec *out, long stack_cells)
+{
+    char hex[24];
+
+    vec_puts(out, "#ifdef FORTH_CONFIG\n");
+    if (stack_cells) {
+        vec_puts(out, "#define FORTH_STACK_CELLS ");
+        vec_putd(out, (size_t)stack_cells);
+        vec_puts(out, "\n#define FORTH_STACK_VERIFIED\n");
+    }
+    if (option_profile) {
+        snprintf(hex, sizeof(hex), "%016" PRIx64,
+            fnv_bytes(FNV_OFFSET, source, source_len));
+        vec_puts(out, "#define FORTH_PROFILE\n");
+        vec_puts(out, "#define FORTH_PROFILE_SOURCE \"");
+        vec_puts(out, hex);
+        vec_puts(out, "\"\n");
+    }
+    if (option_registers) {
+        vec_puts(out, "#define FORTH_REGISTER_ABI\n");
+    }
+    if (uses_threads) {
+        vec_puts(out, "#define FORTH_THREADS\n");
+    }
+    vec_puts(out, "#else\n");
+}
+
+static struct vec *write_live_units(long stack_cells)
+{
+    struct vec *out = vec_new(sizeof(char));
+    struct unit *unit;
+    size_t i;
+
+    write_config(out, stack_cells);
+    for (i = 0; i < units->len; i++) {
+        unit = vec_get(units, i);
+        if (unit->live) {
+            vec_putc(out, '\n');
+            vec_putb(out, (char *)unit->code->bytes, unit->code->len);
+            record_symbol(unit->c_name, unit->c_name);
+        }
+    }
+    vec_puts(out, "\n#endif\n");
+    return out;
+}
+
+static void visit_calls(size_t root, unsigned char *seen, struct vec *order)
+{
+    struct vec *work = vec_new(sizeof(size_t));
+    struct unit *unit;
+    size_t i, j;
+
+    *(size_t *)vec_reserve(work, 1) = root;
+    while (work->len) {
+        i = *(size_t *)vec_get(work, --work->len);
+        unit = vec_get(units, i);
+        if (seen[i] || !unit->live) {
+            continue;
+        }
+        seen[i] = 1;
+        *(size_t *)vec_reserve(order, 1) = i;
+        for (j = unit->uses->len; j; j--) {
+            *(size_t *)vec_reserve(work, 1)
+                = *(size_t *)vec_get(unit->uses, j - 1);
+        }
+    }
+}
+
+// The live units in depth-first order of references from main, so that
+// callers and their callees end up close together.
+static struct vec *call_graph_order(void)
+{
+    struct definition *def = lookup("main", 0);
+    struct vec *order = vec_new(sizeof(size_t));
+    unsigned char *seen = zeroalloc(units->len + 1);
+    size_t i;
+
+    if (def && def->unit) {
+        visit_calls(def->unit - 1, seen, order);
+    }
+    for (i = 0; i < units->len; i++) {
+        visit_calls(i, seen, order);
+    }
+    return order;
+}
+
+static void write_shard_prologue(struct vec *out, const char *header)
+{
+    vec_puts(out, "#define FORTH_CONFIG\n#include \"");
+    vec_puts(out, header);
+    vec_puts(out, "\"\n#undef FORTH_CONFIG\n\n#include \"forth.h\"\n");
+    vec_puts(out, "#include \"");
+    vec_puts(out, header);
+    vec_puts(out, "\"\n");
+}
+
+// The header declares every function and variable, and each shard defines
+// a run of them in call graph order. The runs are cut where the shards
+// come out about the same size.
+static void write_shards(long stack_cells)
+{
+    struct vec *order = call_graph_order();
+    struct vec *header = vec_new(sizeof(char));
+    struct vec **shards = zeroalloc(option_shards * sizeof(*shards));
+    struct vec *name;
+    struct unit *unit;
+    const char *include;
+    size_t len = strlen(option_output);
+    size_t i, shard, done, total;
+
+    if ((len < 3) || strcmp(option_output + len - 2, ".h")) {
+        panic("the output of -S must be a .h file");
+    }
+    include = strrchr(option_output, '/');
+    include = include ? include + 1 : option_output;
+    for (shard = 0; shard < option_shards; shard++) {
+        shards[shard] = vec_new(sizeof(char));
+        write_shard_prologue(shards[shard], include);
+    }
+    write_config(header, stack_cells);
+    vec_putc(header, '\n');
+    for (i = total = 0; i < order->len; i++) {
+        total += ((struct unit *)vec_get(units,
+                      *(size_t *)vec_get(order, i)))->code->len;
+    }
+    for (i = done = 0; i < order->len; i++) {
+        unit = vec_get(units, *(size_t *)vec_get(order, i));
+        if (unit->is_variable) {
+            vec_puts(header, "extern ");
+            if (unit->is_thread_local) {
+                vec_puts(header, "__thread ");
+            }
+            vec_puts(header, "uintptr_t ");
+        } else {
+            vec_puts(header, option_registers ? "forth_regs " : "void ");
+        }
+        vec_puts(header, unit->c_name);
+        record_symbol(unit->c_name, unit->c_name);
+        if (unit->is_variable) {
+            vec_puts(header, ";\n");
+        } else {
+            vec_puts(header,
+                option_registers ? "(forth_regs);\n" : "(void);\n");
+        }
+        shard = done * option_shards / total;
+        vec_putc(shards[shard], '\n');
+        vec_putb(shards[shard], (char *)unit->code->bytes, unit->code->len);
+        done += unit->code->len;
+    }
+    vec_puts(header, "\n#endif\n");
+    for (shard = 0; shard < option_shards; shard++) {
+        name = vec_new(sizeof(char));
+        vec_putb(name, option_output, len - 2);
+        vec_putc(name, '-');
+        vec_putd(name, shard + 1);
+        vec_puts(name, ".c");
+        vec_putc(name, 0);
+        write_file_if_changed((char *)name->bytes, shards[shard]);
+    }
+    write_file_if_changed(option_output, header);
+}
+
+// Writes the assembly to the -o file, which must end in .s, and the header
+// that forth.c includes to the same name ending in .h.
+static void write_asm(long stack_cells)
+{
+    struct vec *header = vec_new(sizeof(char));
+    struct vec *text;
+    struct vec *name;
+    size_t len = strlen(option_output);
 
-    def = define_user(forth_word_setter);
-    display("static void ");
-    display(def->c_func_name);
-    displayln("(void) {");
-    display(indent);
-    display(c_var_name);
-    displayln(" = pop();");
-    displayln("}");
+    if ((len < 3) || strcmp(option_output + len - 2, ".s")) {
+        panic("the output of -a must be a .s file");
+    }
+    write_config(header, stack_cells);
+    vec_puts(header, "\nvoid word_main(void);\nvoid forth_overflow(void)"
+                     " __attribute__((__noreturn__));\n"
+                     "void forth_overflow(void) { die(\"numeric overflow\"); "
+                     "}\nvoid forth_underflow(void)"
+                     " __attribute__((__noreturn__));\n"
+                     "void forth_underflow(void) { die(\"stack underflow\"); "
+                     "}\n");
+    asm_check_pops = !stack_cells;
+    text = translate_image(header);
+    vec_puts(header, "\n#endif\n");
+    name = vec_new(sizeof(char));
+    vec_putb(name, option_output, len - 2);
+    vec_puts(name, ".h");
+    vec_putc(name, 0);
+    write_file_if_changed(option_output, text);
+    write_file_if_changed((char *)name->bytes, header);
 }
 
-static void compile_top_level_definition(void)
+static void write_unit_names(struct vec *out, struct vec *indices)
 {
-    struct token *tok;
-    struct local *local;
-    struct definition *def;
-    struct definition *inner_def;
-    int is_setter;
+    size_t i;
 
-    if (!(tok = read_token(TOK_WORD))) {
-        panic("word name expected");
+    vec_putd(out, indices->len);
+    for (i = 0; i < indices->len; i++) {
+        vec_putc(out, ' ');
+        vec_puts(out,
+            ((struct unit *)vec_get(units, *(size_t *)vec_get(indices, i)))
+                ->c_name);
     }
-    def = define_user(tok->string);
-    display("static void ");
-    display(def->c_func_name);
-    displayln("(void) {");
-    while (!read_the_word(";")) {
-        display(indent);
-        if ((tok = read_token(TOK_WORD))) {
-            const char *forth_word = tok->string;
-            if ((local = lookup_local(forth_word, &is_setter))) {
-                if (!is_setter) {
-                    display("push(");
-                    display(local->c_var_name);
-                    displayln(");");
-                } else {
-                    display(local->c_var_name);
-                    displayln(" = pop();");
+    vec_putc(out, '\n');
+}
+
+static void write_stack_events(struct vec *out, struct vec *events)
+{
+    struct stack_event *event;
+    char s[64];
+    size_t i;
+
+    vec_puts(out, "events ");
+    vec_putd(out, events->len);
+    vec_putc(out, '\n');
+    for (i = 0; i < events->len; i++) {
+        event = vec_get(events, i);
+        snprintf(s, sizeof(s), "%d %d ", event->kind, event->flag);
+        vec_puts(out, s);
+        if (event->kind == STACK_CALL) {
+            vec_puts(out,
+                ((struct unit *)vec_get(units, (size_t)event->arg))->c_name);
+        } else {
+            snprintf(s, sizeof(s), "%ld", event->arg);
+            vec_puts(out, s);
+        }
+        vec_putc(out, '\n');
+    }
+}
+
+// One entry for every colon definition compiled in this run, so that the
+// cache does not keep growing with definitions that have since changed.
+static void write_cache(void)
+{
+    struct vec *out = vec_new(sizeof(char));
+    struct unit *unit;
+    char s[96];
+    size_t i, j;
+
+    vec_puts(out, CACHE_FORMAT "\n");
+    for (i = 0; i < units->len; i++) {
+        unit = vec_get(units, i);
+        if (!unit->hash) {
+            continue;
+        }
+        snprintf(s, sizeof(s), "word %016" PRIx64 " ", unit->hash);
+        vec_puts(out, s);
+        vec_puts(out, unit->c_name);
+        vec_puts(out, "\ncode ");
+        vec_putd(out, unit->code->len);
+        vec_putc(out, '\n');
+        vec_putb(out, (char *)unit->code->bytes, unit->code->len);
+        vec_puts(out, "uses ");
+        write_unit_names(out, unit->uses);
+        write_stack_events(out, unit->stack_events);
+        snprintf(s, sizeof(s), "declared %d %ld %ld\n", unit->declared,
+            unit->declared_in, unit->declared_out);
+        vec_puts(out, s);
+        vec_puts(out, "quotes ");
+        write_unit_names(out, unit->quotes);
+        snprintf(s, sizeof(s), "writes %d %zu", unit->writes_all,
+            unit->writes->len);
+        vec_puts(out, s);
+        for (j = 0; j < unit->writes->len; j++) {
+            vec_putc(out, ' ');
+            vec_puts(out, *(char **)vec_get(unit->writes, j));
+        }
+        vec_puts(out, "\nunchecked ");
+        vec_putd(out, unit->unchecked);
+        vec_puts(out, "\nconstants ");
+        if (unit->constants) {
+            vec_puts(out, "1 ");
+            vec_putd(out, unit->constants->len);
+            for (j = 0; j < unit->constants->len; j++) {
+                snprintf(s, sizeof(s), " %" PRIuPTR,
+                    *(uintptr_t *)vec_get(unit->constants, j));
+                vec_puts(out, s);
+            }
+        } else {
+            vec_puts(out, "0");
+        }
+        vec_puts(out, "\nend\n");
+    }
+    write_file_if_changed(option_cache, out);
+}
+
+static int add_path(struct paths *paths, long level, int flag)
+{
+    size_t i;
+
+    for (i = 0; i < paths->len; i++) {
+        if ((paths->paths[i].level == level)
+            && (paths->paths[i].flag == flag)) {
+            return 1;
+        }
+    }
+    if (paths->len == MAX_PATHS) {
+        return 0;
+    }
+    paths->paths[paths->len].level = level;
+    paths->paths[paths->len].flag = flag;
+    paths->len++;
+    return 1;
+}
+
+static void reach_level(struct effect *effect, long level)
+{
+    effect->min = (level < effect->min) ? level : effect->min;
+    effect->max = (level > effect->max) ? level : effect->max;
+}
+
+// Effects are worked out with an explicit stack of the words waiting for
+// them, because the call graph can be far deeper than the C stack. When
+// the effect of a callee is not known yet, callee_effect asks for it here
+// and the caller is followed again once it is.
+struct effect_request {
+    size_t index;
+    int flag;
+};
+
+static int effect_wanted;
+static struct effect_request effect_want;
+
+// The effect of a callee, or unknown if it recurses or has not been worked
+// out yet.
+static struct effect callee_effect(size_t index, int flag)
+{
+    struct unit *unit = vec_get(units, index);
+    struct effect unknown;
+
+    if (unit->effect_states[flag] == 2) {
+        return unit->effects[flag];
+    }
+    if (unit->effect_states[flag] == 0) {
+        effect_wanted = 1;
+        effect_want.index = index;
+        effect_want.flag = flag;
+    }
+    memset(&unknown, 0, sizeof(unknown));
+    return unknown;
+}
+
+// A quoted word can be called from anywhere, so call has the combined
+// effect of all quoted words.
+static struct effect quoted_effect(int flag)
+{
+    struct effect effect;
+    struct effect e;
+    struct unit *unit;
+    size_t i, j;
+
+    memset(&effect, 0, sizeof(effect));
+    for (i = 0; i < units->len; i++) {
+        unit = vec_get(units, i);
+        if (!unit->quoted) {
+            continue;
+        }
+        e = callee_effect(i, flag);
+        if (!e.known) {
+            return e;
+        }
+        reach_level(&effect, e.min);
+        reach_level(&effect, e.max);
+        for (j = 0; j < e.exits.len; j++) {
+            if (!add_path(&effect.exits, e.exits.paths[j].level,
+                    e.exits.paths[j].flag)) {
+                return e;
+            }
+        }
+        effect.known = 1;
+    }
+    return effect;
+}
+
+// Follow every path through the function, splitting paths where flag
+// decides and where a callee can return in more than one way. The effect is
+// unknown if the word recurses other than through a tail loop, if a tail
+// loop does not keep the stack level, if there are too many paths, or if
+// it calls a word whose effect is unknown.
+static struct effect follow_paths(struct unit *unit, struct paths *entries)
+{
+    struct paths blocks[64];
+    struct paths current, next, *target;
+    struct stack_event *event;
+    struct effect effect, e;
+    struct path *path;
+    size_t nblock = 0;
+    size_t i, j, k;
+
+    memset(&effect, 0, sizeof(effect));
+    current = *entries;
+    for (i = 0; i < unit->stack_events->len; i++) {
+        event = vec_get(unit->stack_events, i);
+        next.len = 0;
+        for (j = 0; j < current.len; j++) {
+            path = &current.paths[j];
+            switch (event->kind) {
+            case STACK_ADJUST:
+                reach_level(&effect, path->level + event->arg);
+                if (!add_path(&next, path->level + event->arg, path->flag)) {
+                    return effect;
                 }
-            } else if ((inner_def = lookup(forth_word, 0))) {
-                if (inner_def->tag == DEF_COMPILE) {
-                    inner_def->compile();
-                } else if ((inner_def->tag == DEF_PRIMITIVE)
-                    || (inner_def->tag == DEF_USER)) {
-                    display(inner_def->c_func_name);
-                    displayln("();");
-                } else {
-                    panic1("cannot use that in a definition:", forth_word);
+                break;
+            case STACK_SET_FLAG:
+                if (!add_path(&next, path->level, FLAG_UNKNOWN)) {
+                    return effect;
                 }
-            } else {
-                panic1("not defined:", forth_word);
-            }
-        } else if ((tok = read_token(TOK_STRING))) {
-            display("push((uintptr_t)(unsigned char *)");
-            display("\"");
-            display(tok->string);
-            display("\"");
-            displayln(");");
-        } else if ((tok = read_token(TOK_CHAR | TOK_UINT))) {
-            display("push(");
-            display_uintptr(tok->number);
-            displayln(");");
-        } else if ((tok = read_token(TOK_NEGINT))) {
-            display("push((uintptr_t)-(intptr_t)");
-            display_uintptr(tok->number);
-            displayln(");");
-        } else {
-            panic("huh?");
+                break;
+            case STACK_EXIT_IF:
+            case STACK_BREAK_IF:
+                target = (event->kind == STACK_EXIT_IF) ? &effect.exits
+                                                        : &blocks[nblock - 1];
+                if (path->flag != !event->flag) {
+                    reach_level(&effect, path->level + event->arg);
+                    if (!add_path(target, path->level + event->arg,
+                            event->flag)) {
+                        return effect;
+                    }
+                }
+                if ((path->flag != event->flag)
+                    && !add_path(&next, path->level, !event->flag)) {
+                    return effect;
+                }
+                break;
+            case STACK_RETURN:
+                if (!add_path(&effect.exits, path->level, path->flag)) {
+                    return effect;
+                }
+                break;
+            case STACK_HALT:
+                break;
+            case STACK_LOOP:
+                if (path->level) {
+                    return effect;
+                }
+                if (!add_path(entries, 0, path->flag)) {
+                    return effect;
+                }
+                break;
+            case STACK_CALL:
+            case STACK_CALL_QUOTED:
+                e = (event->kind == STACK_CALL)
+                    ? callee_effect((size_t)event->arg, path->flag)
+                    : quoted_effect(path->flag);
+                if (!e.known) {
+                    return effect;
+                }
+                reach_level(&effect, path->level + e.min);
+                reach_level(&effect, path->level + e.max);
+                for (k = 0; k < e.exits.len; k++) {
+                    if (!add_path(&next, path->level + e.exits.paths[k].level,
+                            e.exits.paths[k].flag)) {
+                        return effect;
+                    }
+                }
+                break;
+            default:
+                if (!add_path(&next, path->level, path->flag)) {
+                    return effect;
+                }
+                break;
+            }
+        }
+        if (event->kind == STACK_BLOCK) {
+            if (nblock == sizeof(blocks) / sizeof(blocks[0])) {
+                return effect;
+            }
+            blocks[nblock++].len = 0;
+        } else if (event->kind == STACK_END_BLOCK) {
+            nblock--;
+            for (k = 0; k < blocks[nblock].len; k++) {
+                path = &blocks[nblock].paths[k];
+                if (!add_path(&next, path->level, path->flag)) {
+                    return effect;
+                }
+            }
         }
+        current = next;
     }
-    displayln("}");
-    rollback_locals();
+    effect.known = 1;
+    return effect;
 }
 
-static void compile_parentheses(void)
+// A tail loop can come back to the top with flag different from what it
+// was at entry, and then the body is followed again from there as well.
+static struct effect compute_effect(struct unit *unit, int flag)
 {
-    struct token *tok;
-    struct vec *buf;
+    struct paths entries;
+    struct effect effect;
+    size_t nentry;
 
-    if (read_the_word("byte:")) {
-        if (!read_token(TOK_STRING)) {
-            panic("error");
+    entries.len = 0;
+    add_path(&entries, 0, flag);
+    do {
+        nentry = entries.len;
+        effect = follow_paths(unit, &entries);
+    } while (effect.known && (entries.len != nentry));
+    return effect;
+}
+
+static void request_effect(struct vec *work, size_t index, int flag)
+{
+    struct effect_request *request = vec_reserve(work, 1);
+
+    request->index = index;
+    request->flag = flag;
+    ((struct unit *)vec_get(units, index))->effect_states[flag] = 1;
+}
+
+// The words on the stack are in progress, so a call back to one of them is
+// recursion and its effect is unknown.
+static struct effect unit_effect(size_t index, int flag)
+{
+    static struct vec *work;
+    struct effect_request *request;
+    struct effect effect;
+    struct unit *unit;
+
+    if (!work) {
+        work = vec_new(sizeof(struct effect_request));
+    }
+    if (!((struct unit *)vec_get(units, index))->effect_states[flag]) {
+        request_effect(work, index, flag);
+    }
+    while (work->len) {
+        request = vec_get(work, work->len - 1);
+        unit = vec_get(units, request->index);
+        effect_wanted = 0;
+        effect = compute_effect(unit, request->flag);
+        if (effect_wanted) {
+            request_effect(work, effect_want.index, effect_want.flag);
+            continue;
         }
-        if (!read_the_word(")")) {
-            panic("error");
+        unit->effects[request->flag] = effect;
+        unit->effect_states[request->flag] = 2;
+        work->len--;
+    }
+    return callee_effect(index, flag);
+}
+
+static void check_declared_effect(size_t index)
+{
+    struct unit *unit = vec_get(units, index);
+    struct effect effect;
+    char msg[160];
+    size_t i;
+
+    if (!unit->declared) {
+        return;
+    }
+    effect = unit_effect(index, FLAG_UNKNOWN);
+    if (!effect.known) {
+        return;
+    }
+    for (i = 0; i < effect.exits.len; i++) {
+        if ((effect.exits.paths[i].level
+                != unit->declared_out - unit->declared_in)
+            || (-effect.min > unit->declared_in)) {
+            snprintf(msg, sizeof(msg),
+                "stack effect ( %ld -- %ld ) does not match declared "
+                "( %ld -- %ld ):",
+                -effect.min, effect.exits.paths[i].level - effect.min,
+                unit->declared_in, unit->declared_out);
+            panic1(msg, unit->forth_word);
         }
-    } else if (read_the_word("bytes:")) {
-        buf = vec_new(1);
-        while (!read_the_word(")")) {
-            if ((tok = read_token(TOK_STRING))) {
-                vec_puts(buf, tok->string);
-            } else if ((tok = read_token(TOK_UINT))) {
-                intptr_t i = (intptr_t)tok->number;
-                if ((i < 0x00) || (i > 0xff)) {
-                    panic("byte out of range");
+    }
+}
+
+// Returns the number of cells the stack needs, or 0 if that is not known
+// and the runtime has to check every push and pop.
+static long verify_stack(void)
+{
+    struct definition *def = lookup("main", 0);
+    struct effect effect;
+    char msg[128];
+    size_t i;
+
+    for (i = 0; i < units->len; i++) {
+        check_declared_effect(i);
+    }
+    // A spawned word runs on a stack of its own, which is not verified.
+    if (!def || !def->unit || uses_threads) {
+        return 0;
+    }
+    effect = unit_effect(def->unit - 1, 0);
+    if (!effect.known) {
+        return 0;
+    }
+    if (effect.min < 0) {
+        panic("main underflows the stack");
+    }
+    if (option_max_stack && (effect.max > option_max_stack)) {
+        snprintf(msg, sizeof(msg),
+            "main needs %ld stack cells, more than the limit of %ld",
+            effect.max, option_max_stack);
+        panic(msg);
+    }
+    return (effect.max > 0) ? effect.max : 1;
+}
+
+static void report_stack_effects(long stack_cells)
+{
+    struct effect effect;
+    struct unit *unit;
+    size_t i, j, k;
+
+    for (i = 0; i < units->len; i++) {
+        unit = vec_get(units, i);
+        if (!unit->live || !unit->forth_word || !unit->stack_events->len) {
+            continue;
+        }
+        effect = unit_effect(i, FLAG_UNKNOWN);
+        if (!effect.known) {
+            fprintf(stderr, "effect %s: unknown\n", unit->forth_word);
+            continue;
+        }
+        fprintf(stderr, "effect %s: ( %ld --", unit->forth_word, -effect.min);
+        for (j = 0; j < effect.exits.len; j++) {
+            for (k = 0; k < j; k++) {
+                if (effect.exits.paths[k].level
+                    == effect.exits.paths[j].level) {
+                    break;
                 }
-                vec_putc(buf, (char)(unsigned char)i);
+            }
+            if (k == j) {
+                fprintf(stderr, "%s %ld", j ? " or" : "",
+                    effect.exits.paths[j].level - effect.min);
             }
         }
+        fprintf(stderr, " ) max %ld\n", effect.max);
+    }
+    if (stack_cells) {
+        fprintf(stderr, "stack: %ld cells\n", stack_cells);
     } else {
-        vec_mark(locals);
-        while (!read_the_word(")")) {
-            if ((tok = read_token(TOK_WORD))) {
-                add_local(tok->string);
-            } else {
-                panic("wrong thing");
-            }
+        fprintf(stderr, "stack: not verified\n");
+    }
+}
+
+static void report_unchecked(void)
+{
+    struct unit *unit;
+    size_t i;
+
+    for (i = 0; i < units->len; i++) {
+        unit = vec_get(units, i);
+        if (unit->live && unit->forth_word && unit->unchecked) {
+            fprintf(stderr, "unchecked %s: %zu\n", unit->forth_word,
+                unit->unchecked);
         }
-        compile_locals();
     }
 }
 
-static void compile_quote(void)
+static void report_cache(void)
 {
-    struct definition *def;
-    struct token *tok;
-    char *forth_word;
+    struct unit *unit;
+    size_t i, nword = 0;
 
-    if (!(tok = read_token(TOK_WORD))) {
-        panic("word name expected");
+    for (i = 0; i < units->len; i++) {
+        unit = vec_get(units, i);
+        nword += unit->hash ? 1 : 0;
     }
-    forth_word = tok->string;
-    if (!(def = lookup(forth_word, DEF_USER))) {
-        panic1("not defined:", forth_word);
+    fprintf(stderr, "cache: %zu of %zu words reused\n", ncached, nword);
+}
+
+static void report_fusions(void)
+{
+    struct fusion *fusion;
+
+    for (fusion = fusions; fusion->words[0]; fusion++) {
+        if (fusion->fired) {
+            fprintf(stderr, "fusion %s: %zu\n", fusion->op.forth_word,
+                fusion->fired);
+        }
     }
-    display("push((uintptr_t)");
-    display(def->c_func_name);
-    displayln(");");
 }
 
-static void compile_and(void) { displayln("if (!flag) return;"); }
+static double seconds_now(void)
+{
+    struct timespec ts;
 
-static void compile_or(void) { displayln("if (flag) return;"); }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
 
-static void compile_recurse(void)
+// Tokenize the whole source repeatedly with each supported scanner and
+// report the throughput, without compiling anything.
+static void tokenize_benchmark(void)
 {
-    struct definition *def = vec_get(definitions, definitions->len - 1);
-    display(def->c_func_name);
-    displayln("();");
+    const size_t rounds = 10;
+    const struct scanner *chosen = scanner;
+    size_t i, ntoken;
+    double start, elapsed;
+
+    for (scanner = scanners; scanner < scanners + sizeof(scanners)
+             / sizeof(scanners[0]);
+         scanner++) {
+        if (!scanner_is_supported(scanner)) {
+            continue;
+        }
+        ntoken = 0;
+        start = seconds_now();
+        for (i = 0; i < rounds; i++) {
+            tokens->len = 0;
+            source_pos = 0;
+            block_start = SIZE_MAX;
+            tokenize();
+            ntoken += tokens->len;
+        }
+        elapsed = seconds_now() - start;
+        fprintf(stderr, "%-6s %s %zu bytes, %zu tokens: %.1f MB/s\n",
+            scanner->name, scanner == chosen ? "*" : " ", source_len,
+            ntoken / rounds,
+            (double)(source_len * rounds) / elapsed / 1e6);
+    }
+    scanner = chosen;
 }
 
-static int compile_top_level(void)
+// What -b reports, to track how the compiler scales with the size of the
+// program.
+static void report_stats(double start)
 {
-    struct definition *def;
-    struct token *tok;
-    const char *forth_word;
+    double elapsed = seconds_now() - start;
+    struct rusage usage;
 
-    if (read_token(TOK_EOF))
-        return 0;
-    if (!(tok = read_token(TOK_WORD)))
-        panic("unknown top-level syntax");
-    forth_word = tok->string;
-    if (!(def = lookup(forth_word, DEF_TOP_LEVEL)))
-        panic1("no top-level definition: ", forth_word);
-    newline();
-    def->compile();
-    return 1;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        panic("cannot get resource usage");
+    }
+    fprintf(stderr,
+        "stats: %zu bytes, %zu tokens, %zu definitions in %.3f s, "
+        "%.0f tokens/s, peak RSS %ld kB, %zu allocations\n",
+        source_len, tokens->len, definitions->len, elapsed,
+        (double)tokens->len / elapsed, usage.ru_maxrss, nallocation);
+}
+
+static void usage(void)
+{
+    panic("usage: forthc [-DRTabglprt] [-c cache] [-i inline-threshold] "
+          "[-m symbol-map] [-o output] [-S shards] [-s max-stack-cells] "
+          "[-u profile] [source]");
 }
 
-int main(void)
+// A number given to an option, which must be at least min.
+static size_t option_number(const char *arg, size_t min)
 {
-    mangle_pool = vec_new(sizeof(char *));
+    unsigned long n;
+    char *end;
+
+    errno = 0;
+    n = strtoul(arg, &end, 10);
+    if ((end == arg) || *end || errno || (arg[0] == '-') || (n < min)) {
+        usage();
+    }
+    return (size_t)n;
+}
+
+int main(int argc, char **argv)
+{
+    struct vec *generated;
+    double start = seconds_now();
+    long stack_cells = 0;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "DRS:Tabc:gi:lm:o:prs:tu:")) != -1) {
+        switch (ch) {
+        case 'c':
+            option_cache = optarg;
+            break;
+        case 'i':
+            inline_threshold = option_number(optarg, 0);
+            break;
+        case 'l':
+            option_line_directives = 1;
+            break;
+        case 'm':
+            option_symbol_map = optarg;
+            break;
+        case 'p':
+            option_profile = 1;
+            break;
+        case 'r':
+            option_registers = 1;
+            break;
+        case 'u':
+            option_use_profile = optarg;
+            break;
+        case 'o':
+            option_output = optarg;
+            break;
+        case 'S':
+            option_shards = option_number(optarg, 1);
+            break;
+        case 's':
+            option_max_stack = (long)option_number(optarg, 1);
+            break;
+        case 'D':
+            option_list_dropped = 1;
+            break;
+        case 'g':
+            option_global_flag = 1;
+            break;
+        case 'R':
+            option_report = 1;
+            break;
+        case 'b':
+            option_stats = 1;
+            break;
+        case 'T':
+            option_tokenize_benchmark = 1;
+            break;
+        case 't':
+            option_threaded = 1;
+            break;
+        case 'a':
+            option_asm = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc) {
+        source_name = argv[optind++];
+    }
+    if ((optind != argc) || (option_shards && !option_output)
+        || (option_threaded
+            && (option_shards || option_cache || option_profile
+                || option_use_profile || option_line_directives
+                || option_symbol_map))
+        || (option_asm
+            && (option_threaded || option_shards || option_cache
+                || option_profile || option_use_profile
+                || option_line_directives || !option_output))
+        || (option_registers
+            && (option_threaded || option_asm || option_profile
+                || option_global_flag))) {
+        usage();
+    }
+    if (option_shards) {
+        linkage = "";
+    }
+    if (option_registers) {
+        return_statement = "FORTH_RETURN;";
+    }
+
+    mangle_pool = table_new();
+    mangle_suffixes = table_new();
+    local_pool = table_new();
+    local_suffixes = table_new();
     definitions = vec_new(sizeof(struct definition));
+    units = vec_new(sizeof(struct unit));
+    unit_names = table_new();
+    dictionary = table_new();
     locals = vec_new(sizeof(struct local));
+    local_table = table_new();
+    vstack = vec_new(sizeof(struct entry));
+    facts = vec_new(sizeof(struct fact));
+    open_blocks = vec_new(sizeof(struct block));
     tokens = vec_new(sizeof(struct token));
-    source = vec_new(sizeof(char));
+    exit_counters = vec_new(sizeof(char));
+    if (option_symbol_map) {
+        symbol_map = vec_new(sizeof(char));
+    }
 
     define_compile_top_level("variable", compile_top_level_variable);
+    define_compile_top_level(
+        "thread-variable", compile_top_level_thread_variable);
     define_compile_top_level(":", compile_top_level_definition);
+    define_compile_top_level("noinline", compile_top_level_noinline);
 
     define_compile("(", compile_parentheses);
     define_compile("'", compile_quote);
@@ -782,53 +5794,126 @@ int main(void)
     define_compile("|", compile_or);
     define_compile("recurse", compile_recurse);
 
-    define_primitive("<>", "prim_ne");
-    define_primitive("=", "prim_eq");
-    define_primitive("<", "prim_lt");
-    define_primitive("<=", "prim_le");
-    define_primitive(">", "prim_gt");
-    define_primitive(">=", "prim_ge");
-    define_primitive(">=s", "prim_ge_s");
-    define_primitive("+", "prim_plus");
-    define_primitive("+s", "prim_plus_s");
-    define_primitive("+carry", "prim_plus_carry");
-    define_primitive("-", "prim_minus");
-    define_primitive("-s", "prim_minus_s");
-    define_primitive("*", "prim_star");
-    define_primitive("*s", "prim_star_s");
-    define_primitive("@", "prim_fetch");
-    define_primitive("!", "prim_store");
-    define_primitive("byte@", "prim_byte_fetch");
-    define_primitive("byte!", "prim_byte_store");
-    define_primitive("bytes=", "prim_bytes_equal");
-    define_primitive("allocate", "prim_allocate");
-    define_primitive("and-bits", "prim_and_bits");
-    define_primitive("call", "prim_call");
-    define_primitive("cell-bits", "prim_cell_bits");
-    define_primitive("cells", "prim_cells");
-    define_primitive("deallocate", "prim_deallocate");
-    define_primitive("drop", "prim_drop");
-    define_primitive("dup", "prim_dup");
-    define_primitive("flag", "prim_flag");
-    define_primitive("max->n-bits", "prim_max_to_n_bits");
-    define_primitive("n-bits->bitmask", "prim_n_bits_to_bitmask");
-    define_primitive("or-bits", "prim_or_bits");
-    define_primitive("os-error-message", "prim_os_error_message");
-    define_primitive("os-exit", "prim_os_exit");
-    define_primitive("os-read", "prim_os_read");
-    define_primitive("os-write", "prim_os_write");
-    define_primitive("reallocate", "prim_reallocate");
-    define_primitive("show", "prim_show");
-    define_primitive("show-byte", "prim_show_byte");
-    define_primitive("show-bytes", "prim_show_bytes");
-    define_primitive("show-hex", "prim_show_hex");
-    define_primitive("show-stack", "prim_show_stack");
-    define_primitive("shows", "prim_shows");
-    define_primitive("zero-cells", "prim_zero_cells");
+    define_primitive("<>", "prim_ne", 2, 1, 1);
+    define_primitive("=", "prim_eq", 2, 1, 1);
+    define_primitive("<", "prim_lt", 2, 1, 1);
+    define_primitive("<=", "prim_le", 2, 1, 1);
+    define_primitive(">", "prim_gt", 2, 1, 1);
+    define_primitive(">=", "prim_ge", 2, 1, 1);
+    define_primitive(">=s", "prim_ge_s", 2, 1, 1);
+    define_primitive("+", "prim_plus", 2, 1, 0);
+    define_primitive("+s", "prim_plus_s", 2, 1, 0);
+    define_primitive("+carry", "prim_plus_carry", 2, 1, 1);
+    define_primitive("-", "prim_minus", 2, 1, 0);
+    define_primitive("-s", "prim_minus_s", 2, 1, 0);
+    define_primitive("*", "prim_star", 2, 1, 0);
+    define_primitive("*s", "prim_star_s", 2, 1, 0);
+    define_primitive("@", "prim_fetch", 1, 1, 0);
+    define_primitive("!", "prim_store", 2, 0, 0);
+    define_primitive("byte@", "prim_byte_fetch", 1, 1, 0);
+    define_primitive("byte!", "prim_byte_store", 2, 0, 0);
+    define_primitive("bytes=", "prim_bytes_equal", 3, 0, 1);
+    define_primitive("allocate", "prim_allocate", 1, 1, 0);
+    define_primitive("and-bits", "prim_and_bits", 2, 1, 0);
+    define_primitive("call", "prim_call", 1, 0, 0);
+    lookup("call", 0)->calls_quoted = 1;
+    define_primitive("cell-bits", "prim_cell_bits", 0, 1, 0);
+    define_primitive("cells", "prim_cells", 1, 1, 0);
+    define_primitive("deallocate", "prim_deallocate", 1, 0, 0);
+    define_primitive("drop", "prim_drop", 1, 0, 0);
+    define_primitive("dup", "prim_dup", 1, 2, 0);
+    define_primitive("flag", "prim_flag", 0, 1, 0);
+    define_primitive("max->n-bits", "prim_max_to_n_bits", 1, 1, 0);
+    define_primitive("n-bits->bitmask", "prim_n_bits_to_bitmask", 1, 1, 0);
+    define_primitive("or-bits", "prim_or_bits", 2, 1, 0);
+    define_primitive("os-error-message", "prim_os_error_message", 1, 2, 0);
+    define_primitive("os-exit", "prim_os_exit", 1, 0, 0);
+    lookup("os-exit", 0)->noreturn = 1;
+    define_primitive("os-read", "prim_os_read", 3, 1, 1);
+    define_primitive("os-write", "prim_os_write", 3, 1, 1);
+    define_primitive("reallocate", "prim_reallocate", 2, 1, 0);
+    define_primitive("show", "prim_show", 1, 1, 0);
+    define_primitive("show-byte", "prim_show_byte", 1, 1, 0);
+    define_primitive("show-bytes", "prim_show_bytes", 2, 0, 0);
+    define_primitive("show-hex", "prim_show_hex", 1, 1, 0);
+    define_primitive("show-stack", "prim_show_stack", 0, 0, 0);
+    lookup("show-stack", 0)->reads_flag = 1;
+    define_primitive("shows", "prim_shows", 1, 1, 0);
+    define_primitive("spawn", "prim_spawn", 2, 1, 0);
+    lookup("spawn", 0)->syncs = 1;
+    define_primitive("join", "prim_join", 1, 1, 0);
+    lookup("join", 0)->syncs = 1;
+    define_primitive("zero-cells", "prim_zero_cells", 2, 0, 0);
+    if (option_threaded || option_asm) {
+        define_threaded_words();
+    }
 
+    init_char_classes();
+    choose_scanner();
     slurp();
+    if (option_tokenize_benchmark) {
+        tokenize_benchmark();
+        return 0;
+    }
     tokenize();
+    uses_threads = find_thread_words();
+    if (uses_threads && (option_threaded || option_asm || option_profile)) {
+        panic("spawn and thread-variable cannot be used with -a, -p or -t");
+    }
+    if (option_cache && !hash_compiler(argv[0])) {
+        fprintf(stderr, "warning: cannot read %s, not using the cache\n",
+            argv[0]);
+        option_cache = 0;
+    }
+    if (option_cache) {
+        load_cache();
+    }
+    if (option_use_profile) {
+        load_profile();
+    }
+    image = vec_new(sizeof(char));
+    vec_puts(image, "forth-image 1\n");
     while (compile_top_level())
         ;
+    if (option_threaded) {
+        generated = image;
+    } else if (option_asm) {
+        asm_names = table_new();
+        stack_cells = verify_stack();
+        write_asm(stack_cells);
+        generated = 0;
+    } else {
+        mark_live_units();
+        stack_cells = verify_stack();
+        if (option_list_dropped) {
+            list_dropped_units();
+        }
+        generated = option_shards ? 0 : write_live_units(stack_cells);
+        if (option_shards) {
+            write_shards(stack_cells);
+        }
+    }
+    if (generated && option_output) {
+        write_file_if_changed(option_output, generated);
+    } else if (generated) {
+        fwrite(generated->bytes, 1, generated->len, stdout);
+    }
+    if (symbol_map) {
+        write_file_if_changed(option_symbol_map, symbol_map);
+    }
+    if (option_cache) {
+        write_cache();
+    }
+    if (option_report && !option_threaded && !option_asm) {
+        if (option_cache) {
+            report_cache();
+        }
+        report_fusions();
+        report_unchecked();
+        report_stack_effects(stack_cells);
+    }
+    if (option_stats) {
+        report_stats(start);
+    }
     return 0;
 }
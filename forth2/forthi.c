@@ -0,0 +1,483 @@
+// Threaded-code interpreter: runs an image written by forthc -t, so that a
+// Forth program can run without going through a C compiler first.
+//
+// The loader turns the image into direct-threaded code, an array of cells
+// holding the addresses of the interpreter's labels with their operands in
+// between, and the inner interpreter jumps from label to label.
+
+// Labels as values are a GNU extension.
+#ifdef __clang__
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+#include "forth.h"
+#include "forth_stack.h"
+
+#define IMAGE_FORMAT "forth-image 1"
+
+#define RETURN_STACK_FRAMES 65536
+#define LOCALS_CELLS 65536
+
+// Every primitive in forth.h except prim_call, which runs a C function.
+// Images call quoted words with "execute" instead.
+#define FORTH_PRIMS(X)                                                       \
+    X(prim_flag)                                                             \
+    X(prim_drop)                                                             \
+    X(prim_dup)                                                              \
+    X(prim_ne)                                                               \
+    X(prim_eq)                                                               \
+    X(prim_lt)                                                               \
+    X(prim_lt_s)                                                             \
+    X(prim_gt)                                                               \
+    X(prim_gt_s)                                                             \
+    X(prim_le)                                                               \
+    X(prim_le_s)                                                             \
+    X(prim_ge)                                                               \
+    X(prim_ge_s)                                                             \
+    X(prim_plus)                                                             \
+    X(prim_plus_carry)                                                       \
+    X(prim_plus_s)                                                           \
+    X(prim_minus)                                                            \
+    X(prim_minus_s)                                                          \
+    X(prim_star)                                                             \
+    X(prim_star_s)                                                           \
+    X(prim_cells)                                                            \
+    X(prim_cell_bits)                                                        \
+    X(prim_max_to_n_bits)                                                    \
+    X(prim_n_bits_to_bitmask)                                                \
+    X(prim_and_bits)                                                         \
+    X(prim_or_bits)                                                          \
+    X(prim_allocate)                                                         \
+    X(prim_reallocate)                                                       \
+    X(prim_deallocate)                                                       \
+    X(prim_fetch)                                                            \
+    X(prim_store)                                                            \
+    X(prim_byte_fetch)                                                       \
+    X(prim_byte_store)                                                       \
+    X(prim_bytes_equal)                                                      \
+    X(prim_zero_cells)                                                       \
+    X(prim_show)                                                             \
+    X(prim_shows)                                                            \
+    X(prim_show_hex)                                                         \
+    X(prim_show_byte)                                                        \
+    X(prim_show_bytes)                                                       \
+    X(prim_show_stack)                                                       \
+    X(prim_os_error_message)                                                 \
+    X(prim_os_exit)                                                          \
+    X(prim_os_read)                                                          \
+    X(prim_os_write)
+
+// Instructions with an operand come first.
+enum {
+    OP_LIT,
+    OP_CALL,
+    OP_JUMP,
+    OP_FRAME,
+    OP_BIND,
+    OP_LOCAL,
+    OP_VAR,
+    OP_VAR_STORE,
+    OP_EXECUTE,
+    OP_EXIT,
+    OP_AND,
+    OP_OR,
+    OP_HALT,
+#define X(name) OP_##name,
+    FORTH_PRIMS(X)
+#undef X
+        NOPS
+};
+
+#define NOPERAND (OP_VAR_STORE + 1)
+
+static const char *mnemonics[NOPS] = { "lit", 0, 0, "frame", "bind",
+    "local", 0, 0, "execute", "exit", "and", "or", 0,
+#define X(name) #name,
+    FORTH_PRIMS(X)
+#undef X
+};
+
+union cell {
+    const void *label;
+    uintptr_t value;
+    uintptr_t *variable;
+};
+
+struct frame {
+    const union cell *ip;
+    uintptr_t *fp;
+};
+
+struct symbol {
+    char *name;
+    uintptr_t value;
+};
+
+// Open-addressing hash table from names to values.
+struct symbols {
+    struct symbol *slots;
+    size_t cap;
+    size_t len;
+};
+
+bool flag;
+
+static const void *const *labels;
+static union cell *code;
+static size_t ncell;
+static size_t cap;
+
+static struct symbols ops; // mnemonic -> instruction
+static struct symbols words; // name -> address of its code
+static struct symbols variables; // name -> address of its cell
+
+static struct frame return_stack[RETURN_STACK_FRAMES];
+static uintptr_t locals[LOCALS_CELLS];
+
+static const char *image;
+static size_t image_pos;
+static size_t image_len;
+
+// Called with null, returns the labels of the instructions for the loader.
+static void interpret(const union cell *ip)
+{
+    static const void *const op_labels[NOPS] = { &&op_lit, &&op_call,
+        &&op_jump, &&op_frame, &&op_bind, &&op_local, &&op_var,
+        &&op_var_store, &&op_execute, &&op_exit, &&op_and, &&op_or,
+        &&op_halt,
+#define X(name) &&op_##name,
+        FORTH_PRIMS(X)
+#undef X
+    };
+    struct frame *rp = return_stack;
+    uintptr_t *fp = locals;
+    uintptr_t *lp = locals;
+    uintptr_t target;
+
+    if (!ip) {
+        labels = op_labels;
+        return;
+    }
+#define NEXT goto *(ip++)->label
+    NEXT;
+op_lit:
+    push((ip++)->value);
+    NEXT;
+op_call:
+    target = (ip++)->value;
+enter:
+    if (rp == return_stack + RETURN_STACK_FRAMES) {
+        die("return stack overflow");
+    }
+    rp->ip = ip;
+    rp->fp = fp;
+    rp++;
+    fp = lp;
+    ip = code + target;
+    NEXT;
+op_execute:
+    if ((target = pop()) >= ncell) {
+        die("execute: not the address of a word");
+    }
+    goto enter;
+op_jump:
+    ip = code + ip->value;
+    NEXT;
+op_frame:
+    if ((ip->value) > (size_t)(locals + LOCALS_CELLS - lp)) {
+        die("too many locals");
+    }
+    lp += (ip++)->value;
+    NEXT;
+op_bind:
+    fp[(ip++)->value] = pop();
+    NEXT;
+op_local:
+    push(fp[(ip++)->value]);
+    NEXT;
+op_var:
+    push(*(ip++)->variable);
+    NEXT;
+op_var_store:
+    *(ip++)->variable = pop();
+    NEXT;
+op_and:
+    if (flag) {
+        NEXT;
+    }
+    goto op_exit;
+op_or:
+    if (!flag) {
+        NEXT;
+    }
+op_exit:
+    lp = fp;
+    rp--;
+    ip = rp->ip;
+    fp = rp->fp;
+    NEXT;
+op_halt:
+    return;
+#define X(name)                                                              \
+    op_##name : name();                                                      \
+    NEXT;
+    FORTH_PRIMS(X)
+#undef X
+#undef NEXT
+}
+
+static void read_image(const char *name)
+{
+    FILE *file;
+    char *buf = 0;
+    size_t n, buf_cap = 0;
+
+    if (!(file = fopen(name, "rb"))) {
+        die("cannot open image");
+    }
+    do {
+        buf_cap = buf_cap ? 2 * buf_cap : 65536;
+        buf = die_if_no_memory(realloc(buf, buf_cap));
+        n = fread(buf + image_len, 1, buf_cap - image_len, file);
+        image_len += n;
+    } while (image_len == buf_cap);
+    if (ferror(file) || fclose(file)) {
+        die("cannot read image");
+    }
+    image = buf;
+}
+
+static size_t hash_span(const char *str, size_t len)
+{
+    size_t hash = 2166136261u;
+
+    for (; len; len--, str++) {
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    }
+    return hash;
+}
+
+static struct symbol *symbol_slot(
+    struct symbols *table, const char *name, size_t len)
+{
+    struct symbol *sym;
+    size_t i;
+
+    for (i = hash_span(name, len);; i++) {
+        sym = &table->slots[i & (table->cap - 1)];
+        if (!sym->name
+            || (!strncmp(sym->name, name, len) && !sym->name[len])) {
+            return sym;
+        }
+    }
+}
+
+static void define_symbol(
+    struct symbols *table, const char *name, size_t len, uintptr_t value)
+{
+    struct symbol *old = table->slots;
+    struct symbol *sym;
+    size_t old_cap = table->cap;
+    size_t i;
+
+    if (2 * (table->len + 1) > table->cap) {
+        table->cap = old_cap ? 2 * old_cap : 256;
+        table->slots
+            = die_if_no_memory(calloc(table->cap, sizeof(*table->slots)));
+        for (i = 0; i < old_cap; i++) {
+            if (old[i].name) {
+                *symbol_slot(table, old[i].name, strlen(old[i].name))
+                    = old[i];
+            }
+        }
+        free(old);
+    }
+    sym = symbol_slot(table, name, len);
+    if (!sym->name) {
+        sym->name = die_if_no_memory(calloc(1, len + 1));
+        memcpy(sym->name, name, len);
+        table->len++;
+    }
+    sym->value = value;
+}
+
+static uintptr_t symbol_value(
+    struct symbols *table, const char *name, size_t len)
+{
+    struct symbol *sym = table->cap ? symbol_slot(table, name, len) : 0;
+
+    if (!sym || !sym->name) {
+        die("image refers to an undefined name");
+    }
+    return sym->value;
+}
+
+static const char *next_word(size_t *out_len)
+{
+    size_t start;
+
+    while ((image_pos < image_len) && (image[image_pos] == ' '
+                                          || image[image_pos] == '\n')) {
+        image_pos++;
+    }
+    start = image_pos;
+    while ((image_pos < image_len) && (image[image_pos] != ' ')
+        && (image[image_pos] != '\n')) {
+        image_pos++;
+    }
+    *out_len = image_pos - start;
+    return image + start;
+}
+
+static uintptr_t next_number(void)
+{
+    const char *word;
+    uintptr_t n = 0;
+    size_t len;
+
+    word = next_word(&len);
+    if (!len) {
+        die("image is corrupt");
+    }
+    for (; len; len--, word++) {
+        if ((*word < '0') || (*word > '9')) {
+            die("image is corrupt");
+        }
+        n = 10 * n + (uintptr_t)(*word - '0');
+    }
+    return n;
+}
+
+static uintptr_t next_symbol(struct symbols *table)
+{
+    const char *word;
+    size_t len;
+
+    word = next_word(&len);
+    return symbol_value(table, word, len);
+}
+
+static void put_cell(union cell cell)
+{
+    if (ncell == cap) {
+        cap = cap ? 2 * cap : 4096;
+        code = die_if_no_memory(realloc(code, cap * sizeof(*code)));
+    }
+    code[ncell++] = cell;
+}
+
+static void put_op(int op)
+{
+    union cell cell;
+
+    cell.label = labels[op];
+    put_cell(cell);
+}
+
+static void put_value(uintptr_t value)
+{
+    union cell cell;
+
+    cell.value = value;
+    put_cell(cell);
+}
+
+static int span_equals(const char *span, size_t len, const char *str)
+{
+    return !strncmp(span, str, len) && !str[len];
+}
+
+static void load_string(void)
+{
+    char *bytes;
+    size_t n;
+
+    n = next_number();
+    if ((image_pos == image_len) || (image_len - image_pos - 1 < n)) {
+        die("image is corrupt");
+    }
+    bytes = die_if_no_memory(calloc(1, n + 1));
+    memcpy(bytes, image + image_pos + 1, n);
+    image_pos += n + 1;
+    put_op(OP_LIT);
+    put_value((uintptr_t)bytes);
+}
+
+// Words and variables are defined before they are used, so one pass
+// resolves every name. Returns the address of the code that runs main.
+static size_t load_image(void)
+{
+    const char *word;
+    size_t len, top = 0, start;
+    uintptr_t op, *variable;
+
+    len = strlen(IMAGE_FORMAT);
+    if ((image_len <= len) || memcmp(image, IMAGE_FORMAT, len)
+        || (image[len] != '\n')) {
+        die("not an image, or written by another version of forthc");
+    }
+    image_pos = len;
+    for (op = 0; op < NOPS; op++) {
+        if (mnemonics[op]) {
+            define_symbol(&ops, mnemonics[op], strlen(mnemonics[op]), op);
+        }
+    }
+    for (;;) {
+        word = next_word(&len);
+        if (!len) {
+            break;
+        } else if (span_equals(word, len, "word")) {
+            word = next_word(&len);
+            define_symbol(&words, word, len, ncell);
+        } else if (span_equals(word, len, "top")) {
+            top = ncell;
+        } else if (span_equals(word, len, "loop")) {
+            put_op(OP_JUMP);
+            put_value(top);
+        } else if (span_equals(word, len, "variable")) {
+            variable = die_if_no_memory(calloc(1, sizeof(*variable)));
+            word = next_word(&len);
+            define_symbol(&variables, word, len, (uintptr_t)variable);
+        } else if (span_equals(word, len, "var")) {
+            put_op(OP_VAR);
+            put_value(next_symbol(&variables));
+        } else if (span_equals(word, len, "var!")) {
+            put_op(OP_VAR_STORE);
+            put_value(next_symbol(&variables));
+        } else if (span_equals(word, len, "call")) {
+            put_op(OP_CALL);
+            put_value(next_symbol(&words));
+        } else if (span_equals(word, len, "quote")) {
+            put_op(OP_LIT);
+            put_value(next_symbol(&words));
+        } else if (span_equals(word, len, "string")) {
+            load_string();
+        } else {
+            put_op((int)(op = symbol_value(&ops, word, len)));
+            if (op < NOPERAND) {
+                put_value(next_number());
+            }
+        }
+    }
+    start = ncell;
+    put_op(OP_CALL);
+    put_value(symbol_value(&words, "word_main", strlen("word_main")));
+    put_op(OP_HALT);
+    return start;
+}
+
+int main(int argc, char **argv)
+{
+    size_t start;
+
+    if (argc != 2) {
+        die("usage: forthi image");
+    }
+    stack_init();
+    interpret(0);
+    read_image(argv[1]);
+    start = load_image();
+    interpret(code + start);
+    return 0;
+}